@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
 #define ERR_INCORRECT_USAGE 1
 #define ERR_SAME_FILE 2
@@ -13,94 +24,900 @@
 #define ERR_TARGET_WRITE 8
 #define ERR_TARGET_CLOSE 9
 #define ERR_SOURCE_REMOVE 10
+#define ERR_CLONE 11
 
-int main(int argc, char* argv[]) {
-	if (argc != 3) {
-		fprintf(stderr, "Incorrent number of arguments provided. Usage: ./move infile outfile\n");
-		return ERR_INCORRECT_USAGE;
+/* Largest request handed to the kernel in one copy_file_range/sendfile/splice call */
+#define KERNEL_CHUNK_SIZE (1L << 30)
+/* Size of the reusable buffer for the read/write fallback */
+#define COPY_BUFFER_SIZE (4 << 20)
+/* Capacity of the queue between the tree walker and the workers */
+#define QUEUE_SIZE 1024
+/* Copies whose publication waits for one shared syncfs in durable batch moves */
+#define DURABLE_GROUP 256
+/* Length that makes the copy helpers run up to EOF */
+#define OFF_MAX ((off_t)(~0ULL >> 1))
+
+enum reflink_mode {
+	REFLINK_NEVER,
+	REFLINK_AUTO,
+	REFLINK_ALWAYS
+};
+
+/* Every worker thread reuses its own copy buffer */
+static __thread char* copy_buffer = NULL;
+static enum reflink_mode reflink = REFLINK_AUTO;
+static int durable = 0;
+static int batch = 0;
+
+/* Errors meaning "this copy method is not available here", not an I/O failure */
+static int method_unsupported(int err) {
+	return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+		err == ENOTSUP || err == EPERM || err == EBADF || err == ESPIPE || err == ENOTTY;
+}
+
+/*
+ * Share the source extents with the target (btrfs, XFS, ...) so that no
+ * data is copied at all. Filesystems without reflink support return
+ * EOPNOTSUPP/EXDEV, in which case the caller falls back to copying unless
+ * cloning is required.
+ */
+static int clone_data(int source, int target) {
+	if (reflink == REFLINK_NEVER)
+		return 1;
+	if (!ioctl(target, FICLONE, source))
+		return 0;
+	if (reflink == REFLINK_ALWAYS || !method_unsupported(errno))
+		return ERR_CLONE;
+	return 1;
+}
+
+/*
+ * Each copy_* helper moves up to *len bytes from the current offset of
+ * source to the current offset of target, stopping early at EOF, and
+ * subtracts what it moved from *len. It returns 0 when done, 1 when the
+ * method is unsupported and the next one should be tried (file offsets stay
+ * consistent, so the next method just continues), or an error code.
+ */
+static int copy_range(int source, int target, off_t* len) {
+	int first = 1;
+	while (*len > 0) {
+		size_t chunk = *len < KERNEL_CHUNK_SIZE ? *len : KERNEL_CHUNK_SIZE;
+		ssize_t n = copy_file_range(source, NULL, target, NULL, chunk, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return method_unsupported(errno) ? 1 : ERR_TARGET_WRITE;
+		}
+		if (n == 0)
+			/* Pseudo files report zero length to copy_file_range */
+			return first ? 1 : 0;
+		*len -= n;
+		first = 0;
 	}
-	const char* infile = argv[1];
-	const char* outfile = argv[2];
+	return 0;
+}
 
-	if (!strcmp(infile, outfile)) {
-		fprintf(stderr, "Same file provided as infile and outfile\n");
-		return ERR_SAME_FILE;
+static int copy_sendfile(int source, int target, off_t* len) {
+	while (*len > 0) {
+		size_t chunk = *len < KERNEL_CHUNK_SIZE ? *len : KERNEL_CHUNK_SIZE;
+		ssize_t n = sendfile(target, source, NULL, chunk);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return method_unsupported(errno) ? 1 : ERR_TARGET_WRITE;
+		}
+		if (n == 0)
+			return 0;
+		*len -= n;
 	}
-	FILE* source = fopen(infile, "rb");
-	if (source == NULL) {
-		fprintf(stderr, "Could not open source file\n");
-		return ERR_SOURCE_OPEN;
+	return 0;
+}
+
+static int copy_splice(int source, int target, off_t* len) {
+	int pipefd[2];
+	if (pipe(pipefd))
+		return 1;
+	int res = 0;
+	while (*len > 0) {
+		size_t chunk = *len < COPY_BUFFER_SIZE ? *len : COPY_BUFFER_SIZE;
+		ssize_t n = splice(source, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			res = method_unsupported(errno) ? 1 : ERR_SOURCE_OPEN;
+			break;
+		}
+		if (n == 0)
+			break;
+		*len -= n;
+		while (n > 0) {
+			ssize_t m = splice(pipefd[0], NULL, target, NULL, n, SPLICE_F_MOVE);
+			if (m < 0) {
+				if (errno == EINTR)
+					continue;
+				/* Data already sits in the pipe, so there is nowhere to fall back to */
+				res = ERR_TARGET_WRITE;
+				break;
+			}
+			n -= m;
+		}
+		if (res)
+			break;
 	}
-	
-	if (fseek(source, 0, SEEK_END)) {
-		fclose(source);
-		fprintf(stderr, "Could not calculate source file size\n");
-		return ERR_FSEEK_SOURCE;
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return res;
+}
+
+static int copy_readwrite(int source, int target, off_t* len) {
+	if (copy_buffer == NULL) {
+		copy_buffer = malloc(COPY_BUFFER_SIZE);
+		if (copy_buffer == NULL)
+			return ERR_MEMORY_ALLOC;
+	}
+	while (*len > 0) {
+		size_t chunk = *len < COPY_BUFFER_SIZE ? *len : COPY_BUFFER_SIZE;
+		ssize_t n = read(source, copy_buffer, chunk);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return ERR_SOURCE_OPEN;
+		}
+		if (n == 0)
+			return 0;
+		*len -= n;
+		char* p = copy_buffer;
+		while (n > 0) {
+			ssize_t m = write(target, p, n);
+			if (m < 0) {
+				if (errno == EINTR)
+					continue;
+				return ERR_TARGET_WRITE;
+			}
+			p += m;
+			n -= m;
+		}
 	}
+	return 0;
+}
 
-	int source_file_size = ftell(source);
-	if (source_file_size == -1) {
-		fclose(source);
-		fprintf(stderr, "Could not calculate source file size\n");
-		return ERR_SOURCE_OPEN;
+/* Stream len bytes (or up to EOF) in constant memory, preferring in-kernel copies */
+static int copy_stream(int source, int target, off_t len) {
+	int res = copy_range(source, target, &len);
+	if (res == 1)
+		res = copy_sendfile(source, target, &len);
+	if (res == 1)
+		res = copy_splice(source, target, &len);
+	if (res == 1)
+		res = copy_readwrite(source, target, &len);
+	return res;
+}
+
+/*
+ * Copy only the data extents of a sparse source, found with SEEK_DATA and
+ * SEEK_HOLE. The target starts empty, so seeking over the holes leaves them
+ * unallocated and the final ftruncate reproduces a trailing hole.
+ */
+static int copy_sparse(int source, int target, off_t size) {
+	off_t offset = 0;
+	while (offset < size) {
+		off_t data = lseek(source, offset, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				break;
+			/* No SEEK_DATA support, copy the whole file instead */
+			return offset == 0 && errno == EINVAL ? 1 : ERR_SOURCE_OPEN;
+		}
+		off_t hole = lseek(source, data, SEEK_HOLE);
+		if (hole == -1 || lseek(source, data, SEEK_SET) == -1)
+			return ERR_SOURCE_OPEN;
+		if (lseek(target, data, SEEK_SET) == -1)
+			return ERR_TARGET_WRITE;
+		int res = copy_stream(source, target, hole - data);
+		if (res)
+			return res;
+		offset = hole;
 	}
-	if (fseek(source, 0, SEEK_SET)) {
-		fclose(source);
-		fprintf(stderr, "Could not calculate source file size\n");
+	if (ftruncate(target, size))
+		return ERR_TARGET_WRITE;
+	return 0;
+}
+
+/* Clone, sparse-copy or stream source into target */
+static int copy_data(int source, int target, const struct stat* st) {
+	int res = clone_data(source, target);
+	/* Fewer allocated blocks than the size implies means there are holes */
+	if (res == 1 && S_ISREG(st->st_mode) && st->st_blocks * 512 < st->st_size)
+		res = copy_sparse(source, target, st->st_size);
+	if (res == 1)
+		res = copy_stream(source, target, OFF_MAX);
+	return res;
+}
+
+/* A source directory and the target directory its entries are moved into */
+struct dir_pair {
+	int source;
+	int target;
+	int refs;
+};
+
+/* One entry to move: source and target are names relative to dirs */
+struct move_task {
+	struct dir_pair* dirs;
+	char* path;
+	const char* source;
+	const char* target;
+	/* Unpublished copy of a durable batch move and its hidden name, NULL for an O_TMPFILE */
+	int fd;
+	char* temp;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct move_task tasks[QUEUE_SIZE];
+	size_t head;
+	size_t count;
+	int closed;
+} queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static long files_moved = 0;
+static long long bytes_copied = 0;
+static int first_error = 0;
+
+static void record_error(int res) {
+	int expected = 0;
+	__atomic_compare_exchange_n(&first_error, &expected, res, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static struct dir_pair* dir_pair_new(int source, int target) {
+	struct dir_pair* dirs = malloc(sizeof(*dirs));
+	if (dirs == NULL)
+		return NULL;
+	dirs->source = source;
+	dirs->target = target;
+	dirs->refs = 1;
+	return dirs;
+}
+
+static void dir_pair_get(struct dir_pair* dirs) {
+	__atomic_add_fetch(&dirs->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void dir_pair_put(struct dir_pair* dirs) {
+	if (__atomic_sub_fetch(&dirs->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (dirs->source >= 0)
+		close(dirs->source);
+	if (dirs->target >= 0)
+		close(dirs->target);
+	free(dirs);
+}
+
+/* Cross-device move of a symbolic link: recreate it instead of following it */
+static int move_symlink(const struct move_task* task) {
+	char link[4096];
+	ssize_t len = readlinkat(task->dirs->source, task->source, link, sizeof(link) - 1);
+	if (len == -1) {
+		fprintf(stderr, "%s: Could not open source file\n", task->path);
 		return ERR_SOURCE_OPEN;
 	}
-	char *buffer = (char*)malloc(source_file_size + 1);
-	if (buffer == NULL && source_file_size > 0) {
-		fclose(source);
-		fprintf(stderr, "Could not allocate memory\n");
-		return ERR_MEMORY_ALLOC;
+	link[len] = '\0';
+	unlinkat(task->dirs->target, task->target, 0);
+	if (symlinkat(link, task->dirs->target, task->target)) {
+		fprintf(stderr, "%s: Could not open target file for writing\n", task->path);
+		return ERR_TARGET_OPEN;
+	}
+	if (unlinkat(task->dirs->source, task->source, 0)) {
+		fprintf(stderr, "%s: Could not remove source file\n", task->path);
+		return ERR_SOURCE_REMOVE;
+	}
+	return 0;
+}
+
+/* Split target into the directory it lives in and its last component */
+static char* target_dir_name(const char* target, const char** base) {
+	const char* slash = strrchr(target, '/');
+	*base = slash ? slash + 1 : target;
+	if (slash == NULL)
+		return strdup(".");
+	if (slash == target)
+		return strdup("/");
+	return strndup(target, slash - target);
+}
+
+/*
+ * Durable moves write into an anonymous O_TMPFILE in the target directory
+ * or, where that is unsupported, into a hidden ".name.XXXXXX" file. *temp
+ * is set to the hidden name, or NULL for an O_TMPFILE.
+ */
+static int open_temp(int dir, const char* target, char** temp) {
+	const char* base;
+	char* parent = target_dir_name(target, &base);
+	if (parent == NULL)
+		return -1;
+	*temp = NULL;
+	int fd = openat(dir, parent, O_TMPFILE | O_WRONLY, 0666);
+	if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+		free(parent);
+		return fd;
+	}
+	size_t len = strlen(parent) + strlen(base) + 16;
+	*temp = malloc(len);
+	if (*temp == NULL) {
+		free(parent);
+		return -1;
 	}
-	if (source_file_size > 0) {
-		size_t bytes_read = fread(buffer, 1, source_file_size, source);
-		if (bytes_read != (size_t)source_file_size) {
-			fclose(source);
-			free(buffer);
-			fprintf(stderr, "Could not read the source file fully\n");
+	unsigned seed = getpid() ^ (unsigned)(size_t)temp ^ (unsigned)time(NULL);
+	for (int attempt = 0; attempt < 100; attempt++) {
+		snprintf(*temp, len, "%s/.%s.%06x", parent, base, rand_r(&seed) & 0xffffff);
+		fd = openat(dir, *temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd != -1 || errno != EEXIST)
+			break;
+	}
+	free(parent);
+	if (fd == -1) {
+		free(*temp);
+		*temp = NULL;
+	}
+	return fd;
+}
+
+/* Atomically put the finished temp file in place of target */
+static int link_temp(int fd, const char* temp, int dir, const char* target) {
+	if (temp != NULL)
+		return renameat(dir, temp, dir, target);
+	char proc[64];
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (!linkat(AT_FDCWD, proc, dir, target, AT_SYMLINK_FOLLOW))
+		return 0;
+	if (errno != EEXIST)
+		return -1;
+	/* linkat cannot replace, so link under a hidden name and rename over target */
+	const char* base;
+	char* parent = target_dir_name(target, &base);
+	char* hidden = parent == NULL ? NULL : malloc(strlen(parent) + strlen(base) + 16);
+	if (hidden == NULL) {
+		free(parent);
+		return -1;
+	}
+	sprintf(hidden, "%s/.%s.%d", parent, base, fd);
+	free(parent);
+	int res = linkat(AT_FDCWD, proc, dir, hidden, AT_SYMLINK_FOLLOW);
+	if (!res && (res = renameat(dir, hidden, dir, target)))
+		unlinkat(dir, hidden, 0);
+	free(hidden);
+	return res;
+}
+
+/* Make the directory entry created by link_temp durable */
+static int sync_parent(int dir, const char* target) {
+	const char* base;
+	char* parent = target_dir_name(target, &base);
+	if (parent == NULL)
+		return -1;
+	int fd = openat(dir, parent, O_RDONLY | O_DIRECTORY);
+	free(parent);
+	if (fd == -1)
+		return -1;
+	int res = fsync(fd);
+	close(fd);
+	return res;
+}
+
+/*
+ * Returns 0 on success. With *deferred set the data is written to task->fd but
+ * not yet known to be on disk, and flush_removals publishes the target and
+ * removes the source.
+ */
+static int move_at(struct move_task* task, off_t* copied, int* deferred) {
+	int sdir = task->dirs->source;
+	int tdir = task->dirs->target;
+	*deferred = 0;
+	if (!renameat(sdir, task->source, tdir, task->target))
+		return 0;
+	/* Only a cross-device rename is done by copying and removing; any other failure would repeat */
+	if (errno != EXDEV) {
+		if (errno == ENOENT) {
+			fprintf(stderr, "%s: Could not open source file\n", task->path);
 			return ERR_SOURCE_OPEN;
 		}
-		buffer[source_file_size] = '\0';
+		fprintf(stderr, "%s: Could not open target file for writing: %s\n", task->path, strerror(errno));
+		return ERR_TARGET_OPEN;
 	}
 
-	if (fclose(source)) {
-		free(buffer);
-		fprintf(stderr, "Could not close source file\n");
-		return ERR_SOURCE_CLOSE;	
+	int source = openat(sdir, task->source, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (source == -1 && errno == ELOOP)
+		return move_symlink(task);
+	if (source == -1) {
+		fprintf(stderr, "%s: Could not open source file\n", task->path);
+		return ERR_SOURCE_OPEN;
 	}
-	
-	FILE* target = fopen(outfile, "wb");
-	if (target == NULL) {
-		free(buffer);
-		fprintf(stderr, "Could not open target file for writing\n");
+	struct stat st;
+	if (fstat(source, &st)) {
+		close(source);
+		fprintf(stderr, "%s: Could not calculate source file size\n", task->path);
+		return ERR_FSEEK_SOURCE;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(source);
+		fprintf(stderr, "%s: Could not open source file: not a regular file\n", task->path);
+		return ERR_SOURCE_OPEN;
+	}
+	posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/* Name to unlink if the copy fails; NULL for an O_TMPFILE */
+	char* temp = NULL;
+	const char* written = task->target;
+	int target;
+	if (durable) {
+		target = open_temp(tdir, task->target, &temp);
+		written = temp;
+	} else {
+		target = openat(tdir, task->target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+	if (target == -1) {
+		close(source);
+		fprintf(stderr, "%s: Could not open target file for writing\n", task->path);
 		return ERR_TARGET_OPEN;
 	}
-	if (source_file_size > 0) {
-		size_t bytes_write = fwrite(buffer, 1, source_file_size, target);
-		if (bytes_write != (size_t)source_file_size) {
-			//fclose(source);
-			free(buffer);
-			fclose(target);
-			fprintf(stderr, "Could not write to the target file fully\n");
-			return ERR_TARGET_WRITE;
-		}
+
+	int res = copy_data(source, target, &st);
+	/* In a batch one syncfs per group replaces the per-file fsync, before anything is published */
+	if (!res && durable && !batch && fsync(target))
+		res = ERR_TARGET_WRITE;
+	if (res) {
+		close(source);
+		close(target);
+		if (written != NULL)
+			unlinkat(tdir, written, 0);
+		free(temp);
+		if (res == ERR_MEMORY_ALLOC)
+			fprintf(stderr, "%s: Could not allocate memory\n", task->path);
+		else if (res == ERR_CLONE)
+			fprintf(stderr, "%s: Could not clone source file: %s\n", task->path, strerror(errno));
+		else if (res == ERR_SOURCE_OPEN)
+			fprintf(stderr, "%s: Could not read the source file fully: %s\n", task->path, strerror(errno));
+		else
+			fprintf(stderr, "%s: Could not write to the target file fully: %s\n", task->path, strerror(errno));
+		return res;
 	}
-	if (fclose(target)) {
-		free(buffer);
-		fprintf(stderr, "Could not close target file\n");
+
+	if (close(source)) {
+		close(target);
+		if (written != NULL)
+			unlinkat(tdir, written, 0);
+		free(temp);
+		fprintf(stderr, "%s: Could not close source file\n", task->path);
+		return ERR_SOURCE_CLOSE;
+	}
+	*copied = st.st_size;
+	if (durable && batch) {
+		task->fd = target;
+		task->temp = temp;
+		*deferred = 1;
+		return 0;
+	}
+	if (durable && link_temp(target, temp, tdir, task->target)) {
+		close(target);
+		if (temp != NULL)
+			unlinkat(tdir, temp, 0);
+		free(temp);
+		fprintf(stderr, "%s: Could not open target file for writing: %s\n", task->path, strerror(errno));
+		return ERR_TARGET_OPEN;
+	}
+	free(temp);
+	if (close(target)) {
+		/* A durable target is already published with synced data; only the source is kept */
+		if (!durable)
+			unlinkat(tdir, task->target, 0);
+		fprintf(stderr, "%s: Could not close target file\n", task->path);
 		return ERR_TARGET_CLOSE;
 	}
-	source = NULL;
-	target = NULL;
 
-	if (remove(infile)) {
-		free(buffer);
-		fprintf(stderr, "Could not remove source file\n");
+	if (durable && sync_parent(tdir, task->target)) {
+		fprintf(stderr, "%s: Could not close target file: %s\n", task->path, strerror(errno));
+		return ERR_TARGET_CLOSE;
+	}
+	if (unlinkat(sdir, task->source, 0)) {
+		fprintf(stderr, "%s: Could not remove source file\n", task->path);
 		return ERR_SOURCE_REMOVE;
 	}
-	free(buffer);
 	return 0;
 }
+
+/* Copies of a durable batch, published only after their data is synced */
+static struct {
+	pthread_mutex_t lock;
+	struct move_task tasks[DURABLE_GROUP];
+	dev_t devices[DURABLE_GROUP];
+	size_t count;
+} removals = {PTHREAD_MUTEX_INITIALIZER};
+
+/* One syncfs per target filesystem of the group; returns -1 if any fails */
+static int sync_group(struct move_task* tasks, dev_t* devices, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		size_t j = 0;
+		while (j < i && devices[j] != devices[i])
+			j++;
+		if (j == i && syncfs(tasks[i].dirs->target)) {
+			fprintf(stderr, "Could not sync target filesystem: %s\n", strerror(errno));
+			record_error(ERR_TARGET_CLOSE);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sync the data, publish the targets, sync again for their directory
+ * entries and only then remove the sources.
+ */
+static void flush_group(struct move_task* tasks, dev_t* devices, size_t count) {
+	char published[DURABLE_GROUP];
+	int failed = sync_group(tasks, devices, count);
+	for (size_t i = 0; i < count; i++) {
+		int tdir = tasks[i].dirs->target;
+		published[i] = 0;
+		if (!failed) {
+			if (link_temp(tasks[i].fd, tasks[i].temp, tdir, tasks[i].target)) {
+				fprintf(stderr, "%s: Could not open target file for writing: %s\n", tasks[i].path, strerror(errno));
+				record_error(ERR_TARGET_OPEN);
+			} else {
+				published[i] = 1;
+			}
+		}
+		if (!published[i] && tasks[i].temp != NULL)
+			unlinkat(tdir, tasks[i].temp, 0);
+		free(tasks[i].temp);
+		/* A published target is never removed again, so on error both copies stay */
+		if (close(tasks[i].fd) && published[i]) {
+			fprintf(stderr, "%s: Could not close target file\n", tasks[i].path);
+			record_error(ERR_TARGET_CLOSE);
+			published[i] = 0;
+		}
+	}
+	if (!failed)
+		failed = sync_group(tasks, devices, count);
+	for (size_t i = 0; i < count; i++) {
+		/* Without a successful sync the sources are the only safe copy */
+		if (!failed && published[i] && unlinkat(tasks[i].dirs->source, tasks[i].source, 0)) {
+			fprintf(stderr, "%s: Could not remove source file\n", tasks[i].path);
+			record_error(ERR_SOURCE_REMOVE);
+		}
+		dir_pair_put(tasks[i].dirs);
+		free(tasks[i].path);
+	}
+}
+
+/* Moves the pending group into the caller's arrays; called with removals.lock held */
+static size_t take_removals(struct move_task* tasks, dev_t* devices) {
+	size_t count = removals.count;
+	memcpy(tasks, removals.tasks, count * sizeof(*tasks));
+	memcpy(devices, removals.devices, count * sizeof(*devices));
+	removals.count = 0;
+	return count;
+}
+
+static void flush_removals(void) {
+	struct move_task tasks[DURABLE_GROUP];
+	dev_t devices[DURABLE_GROUP];
+	pthread_mutex_lock(&removals.lock);
+	size_t count = take_removals(tasks, devices);
+	pthread_mutex_unlock(&removals.lock);
+	flush_group(tasks, devices, count);
+}
+
+static void defer_removal(struct move_task* task) {
+	struct move_task tasks[DURABLE_GROUP];
+	dev_t devices[DURABLE_GROUP];
+	size_t count = 0;
+	struct stat st;
+	dev_t device = fstat(task->dirs->target, &st) ? 0 : st.st_dev;
+	pthread_mutex_lock(&removals.lock);
+	removals.tasks[removals.count] = *task;
+	removals.devices[removals.count] = device;
+	/* A full group is taken out before unlocking, so no other worker can add past its end */
+	if (++removals.count == DURABLE_GROUP)
+		count = take_removals(tasks, devices);
+	pthread_mutex_unlock(&removals.lock);
+	if (count)
+		flush_group(tasks, devices, count);
+}
+
+static void run_task(struct move_task* task) {
+	off_t copied = 0;
+	int deferred;
+	int res = move_at(task, &copied, &deferred);
+	if (res) {
+		record_error(res);
+	} else {
+		__atomic_add_fetch(&files_moved, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bytes_copied, copied, __ATOMIC_RELAXED);
+	}
+	if (deferred && !res) {
+		defer_removal(task);
+		return;
+	}
+	dir_pair_put(task->dirs);
+	free(task->path);
+}
+
+static void enqueue(struct dir_pair* dirs, char* path, const char* source, const char* target) {
+	dir_pair_get(dirs);
+	pthread_mutex_lock(&queue.lock);
+	while (queue.count == QUEUE_SIZE)
+		pthread_cond_wait(&queue.not_full, &queue.lock);
+	struct move_task* task = &queue.tasks[(queue.head + queue.count) % QUEUE_SIZE];
+	task->dirs = dirs;
+	task->path = path;
+	task->source = source;
+	task->target = target;
+	queue.count++;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static void* worker(void* arg) {
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		while (queue.count == 0 && !queue.closed)
+			pthread_cond_wait(&queue.not_empty, &queue.lock);
+		if (queue.count == 0) {
+			pthread_mutex_unlock(&queue.lock);
+			break;
+		}
+		struct move_task task = queue.tasks[queue.head];
+		queue.head = (queue.head + 1) % QUEUE_SIZE;
+		queue.count--;
+		pthread_cond_signal(&queue.not_full);
+		pthread_mutex_unlock(&queue.lock);
+		run_task(&task);
+	}
+	free(copy_buffer);
+	return NULL;
+}
+
+/* Source directories emptied by the walk, removed in reverse order once the workers are done */
+static char** emptied_dirs = NULL;
+static size_t emptied_count = 0;
+static size_t emptied_capacity = 0;
+
+static char* join_path(const char* dir, const char* name) {
+	size_t len = strlen(dir);
+	char* path = malloc(len + strlen(name) + 2);
+	if (path == NULL)
+		return NULL;
+	memcpy(path, dir, len);
+	path[len] = '/';
+	strcpy(path + len + 1, name);
+	return path;
+}
+
+/*
+ * A directory that cannot be renamed as a whole is recreated in the target
+ * and its entries are handed to the workers, all relative to directory fds.
+ */
+static void walk_dir(struct dir_pair* dirs, char* path, const char* source, const char* target) {
+	struct stat st;
+	if (fstatat(dirs->source, source, &st, AT_SYMLINK_NOFOLLOW)) {
+		fprintf(stderr, "%s: Could not open source file\n", path);
+		record_error(ERR_SOURCE_OPEN);
+		free(path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		enqueue(dirs, path, source, target);
+		return;
+	}
+	if (!renameat(dirs->source, source, dirs->target, target)) {
+		__atomic_add_fetch(&files_moved, 1, __ATOMIC_RELAXED);
+		free(path);
+		return;
+	}
+	if (errno != EXDEV) {
+		fprintf(stderr, "%s: Could not open target file for writing: %s\n", path, strerror(errno));
+		record_error(ERR_TARGET_OPEN);
+		free(path);
+		return;
+	}
+
+	int sfd = openat(dirs->source, source, O_RDONLY | O_DIRECTORY);
+	if (sfd == -1) {
+		fprintf(stderr, "%s: Could not open source file\n", path);
+		record_error(ERR_SOURCE_OPEN);
+		free(path);
+		return;
+	}
+	if (mkdirat(dirs->target, target, (st.st_mode & 07777) | S_IRWXU) && errno != EEXIST) {
+		close(sfd);
+		fprintf(stderr, "%s: Could not open target file for writing\n", path);
+		record_error(ERR_TARGET_OPEN);
+		free(path);
+		return;
+	}
+	int tfd = openat(dirs->target, target, O_RDONLY | O_DIRECTORY);
+	DIR* dir = tfd == -1 ? NULL : fdopendir(dup(sfd));
+	struct dir_pair* sub = dir == NULL ? NULL : dir_pair_new(sfd, tfd);
+	if (sub == NULL) {
+		if (dir != NULL)
+			closedir(dir);
+		if (tfd != -1)
+			close(tfd);
+		close(sfd);
+		fprintf(stderr, "%s: Could not open target file for writing\n", path);
+		record_error(ERR_TARGET_OPEN);
+		free(path);
+		return;
+	}
+
+	if (emptied_count == emptied_capacity) {
+		emptied_capacity = emptied_capacity ? emptied_capacity * 2 : 64;
+		emptied_dirs = realloc(emptied_dirs, emptied_capacity * sizeof(*emptied_dirs));
+		if (emptied_dirs == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			exit(ERR_MEMORY_ALLOC);
+		}
+	}
+	emptied_dirs[emptied_count++] = path;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		char* child = join_path(path, entry->d_name);
+		if (child == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			record_error(ERR_MEMORY_ALLOC);
+			break;
+		}
+		const char* name = child + strlen(path) + 1;
+		if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)
+			walk_dir(sub, child, name, name);
+		else
+			enqueue(sub, child, name, name);
+	}
+	closedir(dir);
+	dir_pair_put(sub);
+}
+
+static int move_batch(char** sources, int count, const char* target_dir, long jobs) {
+	int tfd = open(target_dir, O_RDONLY | O_DIRECTORY);
+	struct dir_pair* top = tfd == -1 ? NULL : dir_pair_new(AT_FDCWD, tfd);
+	if (top == NULL) {
+		fprintf(stderr, "%s: Could not open target directory\n", target_dir);
+		return ERR_TARGET_OPEN;
+	}
+	pthread_t* workers = malloc(jobs * sizeof(*workers));
+	if (workers == NULL) {
+		fprintf(stderr, "Could not allocate memory\n");
+		return ERR_MEMORY_ALLOC;
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long started = 0;
+	while (started < jobs && !pthread_create(&workers[started], NULL, worker, NULL))
+		started++;
+	if (started == 0) {
+		fprintf(stderr, "Could not start worker threads\n");
+		return ERR_MEMORY_ALLOC;
+	}
+
+	for (int i = 0; i < count; i++) {
+		size_t len = strlen(sources[i]);
+		while (len > 1 && sources[i][len - 1] == '/')
+			sources[i][--len] = '\0';
+		char* path = strdup(sources[i]);
+		if (path == NULL) {
+			fprintf(stderr, "Could not allocate memory\n");
+			record_error(ERR_MEMORY_ALLOC);
+			break;
+		}
+		const char* base = strrchr(path, '/');
+		base = base ? base + 1 : path;
+		walk_dir(top, path, path, base);
+	}
+
+	pthread_mutex_lock(&queue.lock);
+	queue.closed = 1;
+	pthread_cond_broadcast(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+	for (long i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	flush_removals();
+	dir_pair_put(top);
+
+	while (emptied_count > 0) {
+		char* path = emptied_dirs[--emptied_count];
+		/* A directory left non-empty by a failed entry was already reported */
+		if (rmdir(path) && !(errno == ENOTEMPTY && first_error)) {
+			fprintf(stderr, "%s: Could not remove source file\n", path);
+			record_error(ERR_SOURCE_REMOVE);
+		}
+		free(path);
+	}
+	free(emptied_dirs);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (seconds <= 0)
+		seconds = 1e-9;
+	printf("Moved %ld files, copied %lld bytes in %.3f s: %.0f files/s, %.1f MB/s\n",
+		files_moved, bytes_copied, seconds, files_moved / seconds, bytes_copied / seconds / 1e6);
+	return first_error;
+}
+
+static const char* usage =
+	"Usage: ./move [--reflink[=always|auto|never]] [--durable] [-j jobs] infile outfile\n"
+	"       ./move [--reflink[=always|auto|never]] [--durable] [-j jobs] source... directory\n";
+
+int main(int argc, char* argv[]) {
+	static struct option long_options[] = {
+		{"reflink", optional_argument, 0, 'r'},
+		{"jobs", required_argument, 0, 'j'},
+		{"durable", no_argument, 0, 'd'},
+		{0, 0, 0, 0}
+	};
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'r':
+				if (optarg == NULL || !strcmp(optarg, "always")) {
+					reflink = REFLINK_ALWAYS;
+				} else if (!strcmp(optarg, "auto")) {
+					reflink = REFLINK_AUTO;
+				} else if (!strcmp(optarg, "never")) {
+					reflink = REFLINK_NEVER;
+				} else {
+					fprintf(stderr, "Unknown reflink mode '%s'. %s", optarg, usage);
+					return ERR_INCORRECT_USAGE;
+				}
+				break;
+			case 'd':
+				durable = 1;
+				break;
+			case 'j':
+				jobs = atol(optarg);
+				if (jobs < 1) {
+					fprintf(stderr, "Incorrect number of jobs '%s'. %s", optarg, usage);
+					return ERR_INCORRECT_USAGE;
+				}
+				break;
+			default:
+				fprintf(stderr, "%s", usage);
+				return ERR_INCORRECT_USAGE;
+		}
+	}
+	if (jobs < 1)
+		jobs = 1;
+	int count = argc - optind;
+	if (count < 2) {
+		fprintf(stderr, "Incorrent number of arguments provided. %s", usage);
+		return ERR_INCORRECT_USAGE;
+	}
+	const char* last = argv[argc - 1];
+	struct stat st;
+	int to_dir = !stat(last, &st) && S_ISDIR(st.st_mode);
+	if (count > 2 && !to_dir) {
+		fprintf(stderr, "Target '%s' is not a directory. %s", last, usage);
+		return ERR_INCORRECT_USAGE;
+	}
+	batch = to_dir;
+	if (to_dir)
+		return move_batch(argv + optind, count - 1, last, jobs);
+
+	if (!strcmp(argv[optind], last)) {
+		fprintf(stderr, "Same file provided as infile and outfile\n");
+		return ERR_SAME_FILE;
+	}
+	struct dir_pair cwd = {AT_FDCWD, AT_FDCWD, 1};
+	struct move_task task = {&cwd, argv[optind], argv[optind], last};
+	off_t copied;
+	int deferred;
+	int res = move_at(&task, &copied, &deferred);
+	free(copy_buffer);
+	return res;
+}
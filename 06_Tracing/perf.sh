@@ -0,0 +1,90 @@
+#!/bin/sh
+# Syscall-budget and throughput checks for the copy path of move.
+#
+# Every size is moved twice under strace -c: once through the in-kernel
+# copy and once with copy_file_range/sendfile/splice faulted so that the
+# read/write loop is used. The number of data syscalls must stay within
+# a budget that only whole-buffer I/O can meet, and peak RSS must not
+# grow with the file size. Throughput is measured without the syscall
+# summary and appended to perf.log.
+#
+# Usage: ./perf.sh [size...]   (sizes as understood by truncate, e.g. 64M)
+
+MOVE=${MOVE:-./move}
+TIME=${TIME:-/usr/bin/time}
+# Data syscalls allowed per MiB copied, on top of a fixed allowance
+CALLS_PER_MB=${CALLS_PER_MB:-1}
+CALLS_FIXED=${CALLS_FIXED:-32}
+# Peak RSS in KiB; the copy buffer is 4 MiB
+MAX_RSS=${MAX_RSS:-16384}
+LOG=${LOG:-perf.log}
+
+FORCE_COPY="-e fault=?rename,?renameat,renameat2:error=EXDEV"
+FORCE_RW="-e fault=copy_file_range,sendfile,splice:error=ENOSYS"
+DATA_CALLS="read,write,copy_file_range,sendfile,splice"
+# Faults only apply to traced syscalls
+RENAME_CALLS="?rename,?renameat,renameat2"
+
+[ $# -gt 0 ] || set -- 1K 64K 1M 16M 256M 1G 4G
+
+if [ ! -x "$TIME" ]; then
+	echo "$TIME not found, peak RSS is not checked"
+	TIME=
+fi
+
+failed=0
+
+calls_of() {
+	awk -v name="$2" '$NF == name { print $4 }' "$1"
+}
+
+for size in "$@"; do
+	rm -f perf.in perf.out
+	head -c "$(numfmt --from=iec "$size")" /dev/zero > perf.in
+	bytes=$(stat -c %s perf.in)
+	budget=$((bytes / 1048576 * CALLS_PER_MB + CALLS_FIXED))
+
+	for method in kernel rw; do
+		faults=$FORCE_COPY
+		[ $method = rw ] && faults="$FORCE_COPY $FORCE_RW"
+
+		strace -f -c -o perf.calls -e trace=$RENAME_CALLS,$DATA_CALLS $faults $MOVE perf.in perf.out
+		res=$?
+		calls=0
+		for name in read write copy_file_range sendfile splice; do
+			n=$(calls_of perf.calls $name)
+			calls=$((calls + ${n:-0}))
+		done
+		if [ $res -ne 0 ] || [ $calls -gt $budget ]; then
+			echo "FAIL $size $method: exit $res, $calls data syscalls (budget $budget)"
+			failed=1
+		fi
+		mv perf.out perf.in
+
+		rss=-
+		if [ -n "$TIME" ]; then
+			rss=$($TIME -f %M strace -f --seccomp-bpf -qq -o /dev/null -e trace=$RENAME_CALLS,copy_file_range,sendfile,splice $faults \
+				$MOVE perf.in perf.out 2>&1 >/dev/null | tail -n 1)
+			# The strace process is part of the measurement, so MAX_RSS leaves room for it
+			if [ "$rss" -gt "$MAX_RSS" ]; then
+				echo "FAIL $size $method: peak RSS $rss KiB (limit $MAX_RSS KiB)"
+				failed=1
+			fi
+			mv perf.out perf.in
+		fi
+
+		start=$(date +%s%N)
+		strace -f --seccomp-bpf -qq -o /dev/null -e trace=$RENAME_CALLS,copy_file_range,sendfile,splice $faults $MOVE perf.in perf.out
+		end=$(date +%s%N)
+		mbs=$(awk -v b="$bytes" -v ns="$((end - start))" 'BEGIN { printf "%.1f", b / 1e6 / (ns / 1e9) }')
+		mv perf.out perf.in
+
+		echo "$size $method: $calls data syscalls (budget $budget), peak RSS $rss KiB, $mbs MB/s"
+		printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\n' "$(date +%s)" \
+			"$(git rev-parse --short HEAD 2>/dev/null || echo -)" \
+			"$size" "$method" "$calls" "$rss" "$mbs" >> "$LOG"
+	done
+done
+rm -f perf.in perf.out perf.calls
+
+exit $failed
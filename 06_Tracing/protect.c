@@ -1,19 +1,552 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <dlfcn.h>
+#include "protect_stats.h"
 
-int (*original_remove)(const char* filename) = NULL;
+/*
+ * Protection rules are read once, before main, from the file named by
+ * PROTECT_CONFIG. Each line is one rule:
+ *
+ *   prefix /srv/data/        absolute path: the file or directory and all below it
+ *   glob   *.db              fnmatch pattern on the path as passed
+ *   inode  /srv/data/keep    inode of this file
+ *   inode  2049:131075       device:inode numbers
+ *
+ * Without PROTECT_CONFIG every path containing "PROTECT" is protected.
+ * The tables are never modified afterwards, so lookups take no locks.
+ *
+ * Globs and substrings cost no syscalls. A prefix rule checked against a
+ * relative path needs the working directory, which each thread caches
+ * until the next chdir or fchdir, or a readlink of /proc/self/fd/N for a
+ * path relative to a directory descriptor. Inode rules cost one fstatat
+ * per checked path.
+ *
+ * With PROTECT_STATS set, per-thread call counters and latency histograms
+ * are published in a shared memory segment (see protect_stats.h) that is
+ * removed at exit, unless PROTECT_STATS is "keep". A process that leaves
+ * through _exit, is killed, or execs a program without protect.so cannot
+ * remove it; such segments, like kept ones, are left to protect_stats,
+ * which removes a segment once its process is gone.
+ */
+
+#define MAX_RULES 4096
+
+struct trie_node {
+	unsigned child;
+	unsigned sibling;
+	unsigned char c;
+	unsigned char terminal;
+};
+
+struct inode_key {
+	dev_t dev;
+	ino_t ino;
+};
+
+/* Prefix trie; node 0 is the root, 0 also means "no node" for child/sibling */
+static struct trie_node* trie = NULL;
+static unsigned trie_size = 0;
+
+/* "*literal*" globs are matched with strstr, the rest with fnmatch */
+static char* substrings[MAX_RULES];
+static int substring_count = 0;
+static char* globs[MAX_RULES];
+static int glob_count = 0;
+
+/* Open-addressing hash set, capacity is a power of two */
+static struct inode_key* inodes = NULL;
+static size_t inode_capacity = 0;
+static size_t inode_count = 0;
+
+static int (*original_remove)(const char*) = NULL;
+static int (*original_unlink)(const char*) = NULL;
+static int (*original_unlinkat)(int, const char*, int) = NULL;
+static int (*original_rmdir)(const char*) = NULL;
+static int (*original_rename)(const char*, const char*) = NULL;
+static int (*original_renameat)(int, const char*, int, const char*) = NULL;
+static int (*original_renameat2)(int, const char*, int, const char*, unsigned) = NULL;
+static int (*original_chdir)(const char*) = NULL;
+static int (*original_fchdir)(int) = NULL;
+
+/* Bumped by every chdir and fchdir, each thread refreshes its copy of the cwd when it changes */
+static unsigned cwd_generation = 1;
+static __thread unsigned cwd_cached = 0;
+static __thread char cwd[PATH_MAX];
+static __thread size_t cwd_len;
+
+static unsigned trie_add_node(unsigned char c) {
+	static unsigned capacity = 0;
+	if (trie_size == capacity) {
+		capacity = capacity ? capacity * 2 : 256;
+		struct trie_node* grown = realloc(trie, capacity * sizeof(*trie));
+		if (grown == NULL)
+			return 0;
+		trie = grown;
+	}
+	trie[trie_size] = (struct trie_node){0, 0, c, 0};
+	return trie_size++;
+}
+
+/*
+ * Drops empty and "." components and trailing slashes and applies ".."
+ * to an absolute path in place. This is lexical: a ".." after a symbolic
+ * link goes back to the directory holding the link.
+ */
+static void normalize_path(char* path) {
+	char* out = path;
+	const char* p = path;
+	while (*p) {
+		while (*p == '/')
+			p++;
+		const char* name = p;
+		while (*p && *p != '/')
+			p++;
+		size_t len = p - name;
+		if (len == 0 || (len == 1 && name[0] == '.'))
+			continue;
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			while (out > path && *--out != '/')
+				;
+			continue;
+		}
+		*out++ = '/';
+		memmove(out, name, len);
+		out += len;
+	}
+	if (out == path)
+		*out++ = '/';
+	*out = '\0';
+}
+
+static void trie_insert(const char* prefix) {
+	if (trie == NULL) {
+		trie_add_node(0);
+		if (trie == NULL)
+			return;
+	}
+	char path[PATH_MAX];
+	if (prefix[0] != '/' || strlen(prefix) >= sizeof(path)) {
+		fprintf(stderr, "protect: Prefix '%s' is not an absolute path\n", prefix);
+		return;
+	}
+	strcpy(path, prefix);
+	normalize_path(path);
+	unsigned node = 0;
+	for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+		unsigned child = trie[node].child;
+		while (child && trie[child].c != *p)
+			child = trie[child].sibling;
+		if (!child) {
+			child = trie_add_node(*p);
+			if (!child)
+				return;
+			trie[child].sibling = trie[node].child;
+			trie[node].child = child;
+		}
+		node = child;
+	}
+	trie[node].terminal = 1;
+}
+
+static int trie_match(const char* path) {
+	unsigned node = 0;
+	for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+		unsigned child = trie[node].child;
+		while (child && trie[child].c != *p)
+			child = trie[child].sibling;
+		if (!child)
+			return 0;
+		node = child;
+		/* A rule covers whole components: /a/b protects /a/b/c but not /a/bc */
+		if (trie[node].terminal && (*p == '/' || p[1] == '/' || p[1] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+static size_t inode_slot(dev_t dev, ino_t ino) {
+	unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)dev;
+	return (h ^ (h >> 29)) & (inode_capacity - 1);
+}
+
+static void inode_insert(dev_t dev, ino_t ino);
+
+static void inode_grow(void) {
+	struct inode_key* old = inodes;
+	size_t old_capacity = inode_capacity;
+	size_t capacity = old_capacity ? old_capacity * 2 : 64;
+	inodes = calloc(capacity, sizeof(*inodes));
+	if (inodes == NULL) {
+		inodes = old;
+		return;
+	}
+	inode_capacity = capacity;
+	inode_count = 0;
+	for (size_t i = 0; i < old_capacity; i++)
+		if (old[i].ino)
+			inode_insert(old[i].dev, old[i].ino);
+	free(old);
+}
+
+static void inode_insert(dev_t dev, ino_t ino) {
+	if ((inode_count + 1) * 2 > inode_capacity)
+		inode_grow();
+	if ((inode_count + 1) * 2 > inode_capacity)
+		return;
+	size_t i = inode_slot(dev, ino);
+	while (inodes[i].ino) {
+		if (inodes[i].dev == dev && inodes[i].ino == ino)
+			return;
+		i = (i + 1) & (inode_capacity - 1);
+	}
+	inodes[i].dev = dev;
+	inodes[i].ino = ino;
+	inode_count++;
+}
+
+static int inode_match(dev_t dev, ino_t ino) {
+	size_t i = inode_slot(dev, ino);
+	while (inodes[i].ino) {
+		if (inodes[i].dev == dev && inodes[i].ino == ino)
+			return 1;
+		i = (i + 1) & (inode_capacity - 1);
+	}
+	return 0;
+}
+
+static void add_glob(const char* pattern) {
+	size_t len = strlen(pattern);
+	if (len > 2 && pattern[0] == '*' && pattern[len - 1] == '*' &&
+			strpbrk(pattern + 1, "*?[\\") == pattern + len - 1) {
+		if (substring_count < MAX_RULES)
+			substrings[substring_count++] = strndup(pattern + 1, len - 2);
+	} else if (glob_count < MAX_RULES) {
+		globs[glob_count++] = strdup(pattern);
+	}
+}
+
+static void add_inode(const char* spec) {
+	unsigned long long dev, ino;
+	char end;
+	struct stat st;
+	if (sscanf(spec, "%llu:%llu%c", &dev, &ino, &end) == 2)
+		inode_insert((dev_t)dev, (ino_t)ino);
+	else if (!lstat(spec, &st))
+		inode_insert(st.st_dev, st.st_ino);
+	else
+		fprintf(stderr, "protect: Could not find '%s' for an inode rule\n", spec);
+}
+
+static void load_rules(const char* config) {
+	FILE* file = fopen(config, "r");
+	if (file == NULL) {
+		fprintf(stderr, "protect: Could not open rules file '%s'\n", config);
+		return;
+	}
+	char line[PATH_MAX + 16];
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = '\0';
+		char* kind = line + strspn(line, " \t");
+		if (*kind == '\0' || *kind == '#')
+			continue;
+		char* value = kind + strcspn(kind, " \t");
+		if (*value)
+			*value++ = '\0';
+		value += strspn(value, " \t");
+		if (*value == '\0') {
+			fprintf(stderr, "protect: Rule '%s' has no value\n", kind);
+		} else if (!strcmp(kind, "prefix")) {
+			trie_insert(value);
+		} else if (!strcmp(kind, "glob")) {
+			add_glob(value);
+		} else if (!strcmp(kind, "inode")) {
+			add_inode(value);
+		} else {
+			fprintf(stderr, "protect: Unknown rule '%s'\n", kind);
+		}
+	}
+	fclose(file);
+}
+
+static struct stats_segment* stats = NULL;
+static __thread struct thread_stats* thread_stats = NULL;
+/* Set for threads in the last slot, which overflow threads share */
+static __thread int stats_shared = 0;
+
+static void stats_open(void) {
+	char name[64];
+	snprintf(name, sizeof(name), STATS_NAME_FORMAT, getpid());
+	int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd == -1)
+		return;
+	void* map = MAP_FAILED;
+	if (!ftruncate(fd, sizeof(struct stats_segment)))
+		map = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return;
+	}
+	stats = map;
+	stats->version = STATS_VERSION;
+	stats->pid = getpid();
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* A forked child must not write into its parent's slots */
+static void stats_after_fork(void) {
+	if (stats != NULL)
+		munmap(stats, sizeof(*stats));
+	stats = NULL;
+	thread_stats = NULL;
+	stats_shared = 0;
+	stats_open();
+}
+
+__attribute__((destructor))
+static void stats_close(void) {
+	const char* mode = getenv("PROTECT_STATS");
+	if (stats == NULL || (mode != NULL && !strcmp(mode, "keep")))
+		return;
+	char name[64];
+	snprintf(name, sizeof(name), STATS_NAME_FORMAT, getpid());
+	shm_unlink(name);
+}
+
+static struct thread_stats* stats_slot(void) {
+	if (thread_stats != NULL)
+		return thread_stats;
+	unsigned i = __atomic_fetch_add(&stats->threads, 1, __ATOMIC_RELAXED);
+	/* Threads beyond the last slot join whoever got it, so every writer there adds atomically */
+	stats_shared = i >= STATS_MAX_THREADS - 1;
+	thread_stats = &stats->slots[stats_shared ? STATS_MAX_THREADS - 1 : i];
+	if (i <= STATS_MAX_THREADS - 1)
+		thread_stats->tid = syscall(SYS_gettid);
+	return thread_stats;
+}
+
+/* clock_gettime goes through the vDSO, so timing costs no syscall */
+static inline uint64_t stats_now(void) {
+	if (stats == NULL)
+		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The owning thread is the only writer, so no locked instruction is needed */
+static inline void stats_add(uint64_t* counter, uint64_t value) {
+	if (stats_shared)
+		__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static void stats_record(enum stats_call call, int blocked, uint64_t start, uint64_t real_start) {
+	if (stats == NULL)
+		return;
+	uint64_t end = stats_now();
+	struct call_stats* c = &stats_slot()->calls[call];
+	if (blocked) {
+		stats_add(&c->blocked, 1);
+	} else {
+		stats_add(&c->allowed, 1);
+		stats_add(&c->real_ns, end - real_start);
+	}
+	unsigned bucket = 63 - __builtin_clzll((end - start) | 1);
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	stats_add(&c->latency[bucket], 1);
+}
+
+static void resolve_symbols(void) {
+	original_remove = dlsym(RTLD_NEXT, "remove");
+	original_unlink = dlsym(RTLD_NEXT, "unlink");
+	original_unlinkat = dlsym(RTLD_NEXT, "unlinkat");
+	original_rmdir = dlsym(RTLD_NEXT, "rmdir");
+	original_rename = dlsym(RTLD_NEXT, "rename");
+	original_renameat = dlsym(RTLD_NEXT, "renameat");
+	original_renameat2 = dlsym(RTLD_NEXT, "renameat2");
+	original_chdir = dlsym(RTLD_NEXT, "chdir");
+	original_fchdir = dlsym(RTLD_NEXT, "fchdir");
+}
+
+__attribute__((constructor))
+static void protect_init(void) {
+	resolve_symbols();
+	if (getenv("PROTECT_STATS") != NULL) {
+		stats_open();
+		pthread_atfork(NULL, NULL, stats_after_fork);
+	}
+	const char* config = getenv("PROTECT_CONFIG");
+	if (config != NULL)
+		load_rules(config);
+	else
+		add_glob("*PROTECT*");
+}
+
+/* Prefix rules are absolute and normalized, so relative paths are resolved against dirfd */
+static const char* absolute_path(int dirfd, const char* path, char* buffer, size_t size) {
+	size_t len;
+	if (path[0] == '/') {
+		if (strlen(path) >= size)
+			return NULL;
+		strcpy(buffer, path);
+		normalize_path(buffer);
+		return buffer;
+	}
+	if (dirfd == AT_FDCWD) {
+		/* Read the generation first, so a chdir racing with getcwd only causes another refresh */
+		unsigned generation = __atomic_load_n(&cwd_generation, __ATOMIC_ACQUIRE);
+		if (cwd_cached != generation) {
+			if (getcwd(cwd, sizeof(cwd)) == NULL)
+				return NULL;
+			cwd_len = strlen(cwd);
+			cwd_cached = generation;
+		}
+		len = cwd_len;
+		if (len >= size)
+			return NULL;
+		memcpy(buffer, cwd, len);
+	} else {
+		char proc[32];
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+		ssize_t n = readlink(proc, buffer, size - 1);
+		if (n < 0)
+			return NULL;
+		len = n;
+	}
+	if (len + strlen(path) + 2 > size)
+		return NULL;
+	buffer[len] = '/';
+	strcpy(buffer + len + 1, path);
+	normalize_path(buffer);
+	return buffer;
+}
+
+static int is_protected(int dirfd, const char* path) {
+	if (path == NULL)
+		return 0;
+	for (int i = 0; i < substring_count; i++)
+		if (strstr(path, substrings[i]) != NULL)
+			return 1;
+	for (int i = 0; i < glob_count; i++)
+		if (!fnmatch(globs[i], path, 0))
+			return 1;
+	if (trie_size > 0) {
+		char buffer[2 * PATH_MAX];
+		const char* absolute = absolute_path(dirfd, path, buffer, sizeof(buffer));
+		if (absolute != NULL && trie_match(absolute))
+			return 1;
+	}
+	if (inode_count > 0) {
+		struct stat st;
+		if (!fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) && inode_match(st.st_dev, st.st_ino))
+			return 1;
+	}
+	return 0;
+}
+
+/* Renaming over a protected file destroys it, renaming to a new protected name does not */
+static int replaces_protected(int dirfd, const char* path) {
+	return is_protected(dirfd, path) && !faccessat(dirfd, path, F_OK, AT_SYMLINK_NOFOLLOW);
+}
+
+static int refuse(enum stats_call call, uint64_t start, const char* filename) {
+	fprintf(stderr, "protected: File '%s' is protected and can't be deleted\n", filename);
+	stats_record(call, 1, start, 0);
+	errno = EPERM;
+	return -1;
+}
+
+/* Calls made by other constructors may arrive before protect_init */
+#define ORIGINAL(name) (original_##name ? original_##name : (resolve_symbols(), original_##name))
+
+/* Time the real call and account it, keeping the errno it set */
+#define CALL_ORIGINAL(call, name, ...) do { \
+	uint64_t real_start = stats_now(); \
+	int res = ORIGINAL(name)(__VA_ARGS__); \
+	int saved_errno = errno; \
+	stats_record(call, 0, start, real_start); \
+	errno = saved_errno; \
+	return res; \
+} while (0)
 
 int remove(const char* filename) {
-    if (original_remove == NULL) {
-        original_remove = dlsym(RTLD_NEXT, "remove");
-    }
-    
-    if (filename != NULL && strstr(filename, "PROTECT") != NULL) {
-        fprintf(stderr, "protected: File '%s' is protected and can't be deleted\n", filename);
-        return 0; 
-    }
-    
-    return original_remove(filename);
-}
\ No newline at end of file
+	uint64_t start = stats_now();
+	if (is_protected(AT_FDCWD, filename))
+		return refuse(CALL_REMOVE, start, filename);
+	CALL_ORIGINAL(CALL_REMOVE, remove, filename);
+}
+
+int unlink(const char* filename) {
+	uint64_t start = stats_now();
+	if (is_protected(AT_FDCWD, filename))
+		return refuse(CALL_UNLINK, start, filename);
+	CALL_ORIGINAL(CALL_UNLINK, unlink, filename);
+}
+
+int unlinkat(int dirfd, const char* filename, int flags) {
+	uint64_t start = stats_now();
+	if (is_protected(dirfd, filename))
+		return refuse(CALL_UNLINKAT, start, filename);
+	CALL_ORIGINAL(CALL_UNLINKAT, unlinkat, dirfd, filename, flags);
+}
+
+int rmdir(const char* filename) {
+	uint64_t start = stats_now();
+	if (is_protected(AT_FDCWD, filename))
+		return refuse(CALL_RMDIR, start, filename);
+	CALL_ORIGINAL(CALL_RMDIR, rmdir, filename);
+}
+
+int rename(const char* oldpath, const char* newpath) {
+	uint64_t start = stats_now();
+	if (is_protected(AT_FDCWD, oldpath))
+		return refuse(CALL_RENAME, start, oldpath);
+	if (replaces_protected(AT_FDCWD, newpath))
+		return refuse(CALL_RENAME, start, newpath);
+	CALL_ORIGINAL(CALL_RENAME, rename, oldpath, newpath);
+}
+
+int renameat(int olddirfd, const char* oldpath, int newdirfd, const char* newpath) {
+	uint64_t start = stats_now();
+	if (is_protected(olddirfd, oldpath))
+		return refuse(CALL_RENAMEAT, start, oldpath);
+	if (replaces_protected(newdirfd, newpath))
+		return refuse(CALL_RENAMEAT, start, newpath);
+	CALL_ORIGINAL(CALL_RENAMEAT, renameat, olddirfd, oldpath, newdirfd, newpath);
+}
+
+int renameat2(int olddirfd, const char* oldpath, int newdirfd, const char* newpath, unsigned flags) {
+	uint64_t start = stats_now();
+	if (is_protected(olddirfd, oldpath))
+		return refuse(CALL_RENAMEAT2, start, oldpath);
+	if (replaces_protected(newdirfd, newpath))
+		return refuse(CALL_RENAMEAT2, start, newpath);
+	CALL_ORIGINAL(CALL_RENAMEAT2, renameat2, olddirfd, oldpath, newdirfd, newpath, flags);
+}
+
+int chdir(const char* path) {
+	int res = ORIGINAL(chdir)(path);
+	__atomic_add_fetch(&cwd_generation, 1, __ATOMIC_RELEASE);
+	return res;
+}
+
+int fchdir(int fd) {
+	int res = ORIGINAL(fchdir)(fd);
+	__atomic_add_fetch(&cwd_generation, 1, __ATOMIC_RELEASE);
+	return res;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "protect_stats.h"
+
+/* Upper bound of the bucket that holds the given fraction of the calls */
+static uint64_t percentile(const uint64_t* latency, uint64_t total, double fraction) {
+	uint64_t seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen > 0 && seen >= total * fraction)
+			return 2ULL << i;
+	}
+	return 0;
+}
+
+static void print_stats(const struct stats_segment* stats) {
+	unsigned threads = stats->threads < STATS_MAX_THREADS ? stats->threads : STATS_MAX_THREADS;
+	printf("%-10s %12s %12s %12s %10s %10s %10s\n",
+		"call", "allowed", "blocked", "real ns/op", "p50 ns", "p99 ns", "max ns");
+	for (int call = 0; call < CALL_COUNT; call++) {
+		struct call_stats sum;
+		memset(&sum, 0, sizeof(sum));
+		for (unsigned t = 0; t < threads; t++) {
+			const struct call_stats* c = &stats->slots[t].calls[call];
+			sum.allowed += c->allowed;
+			sum.blocked += c->blocked;
+			sum.real_ns += c->real_ns;
+			for (int i = 0; i < STATS_BUCKETS; i++)
+				sum.latency[i] += c->latency[i];
+		}
+		uint64_t total = sum.allowed + sum.blocked;
+		printf("%-10s %12llu %12llu %12llu %10llu %10llu %10llu\n", stats_call_names[call],
+			(unsigned long long)sum.allowed, (unsigned long long)sum.blocked,
+			(unsigned long long)(sum.allowed ? sum.real_ns / sum.allowed : 0),
+			(unsigned long long)percentile(sum.latency, total, 0.5),
+			(unsigned long long)percentile(sum.latency, total, 0.99),
+			(unsigned long long)percentile(sum.latency, total, 1.0));
+	}
+	printf("threads: %u\n", stats->threads);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: ./protect_stats pid [interval]\n");
+		return 1;
+	}
+	int interval = argc == 3 ? atoi(argv[2]) : 0;
+	char name[64];
+	snprintf(name, sizeof(name), STATS_NAME_FORMAT, atoi(argv[1]));
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Could not open statistics segment %s\n", name);
+		return 1;
+	}
+	const struct stats_segment* stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats == MAP_FAILED) {
+		fprintf(stderr, "Could not map statistics segment %s\n", name);
+		return 1;
+	}
+	if (stats->magic != STATS_MAGIC || stats->version != STATS_VERSION) {
+		fprintf(stderr, "Statistics segment %s has an unknown format\n", name);
+		return 1;
+	}
+	print_stats(stats);
+	/* Nobody else removes the segment of a process that exited without its destructors */
+	if (interval <= 0 && kill(stats->pid, 0) == -1 && errno == ESRCH)
+		shm_unlink(name);
+	while (interval > 0) {
+		sleep(interval);
+		printf("\n");
+		print_stats(stats);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef PROTECT_STATS_H
+#define PROTECT_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the statistics segment that protect.so publishes in
+ * /dev/shm/protect.<pid> when PROTECT_STATS is set. Each thread owns one
+ * slot and is the only writer of it; readers may see a slot mid-update,
+ * but every counter is an aligned 64-bit word and only ever grows.
+ *
+ * The segment outlives a process that does not run its destructors, so
+ * the reader removes it after printing the statistics of a process that
+ * no longer exists.
+ */
+
+#define STATS_MAGIC 0x50525354
+#define STATS_VERSION 1
+#define STATS_MAX_THREADS 256
+/* Bucket i counts calls that took [2^i, 2^(i+1)) ns */
+#define STATS_BUCKETS 40
+
+enum stats_call {
+	CALL_REMOVE,
+	CALL_UNLINK,
+	CALL_UNLINKAT,
+	CALL_RMDIR,
+	CALL_RENAME,
+	CALL_RENAMEAT,
+	CALL_RENAMEAT2,
+	CALL_COUNT
+};
+
+static const char* const stats_call_names[CALL_COUNT] = {
+	"remove", "unlink", "unlinkat", "rmdir", "rename", "renameat", "renameat2"
+};
+
+struct call_stats {
+	uint64_t allowed;
+	uint64_t blocked;
+	/* Time spent inside the real libc function */
+	uint64_t real_ns;
+	/* Latency of the whole intercepted call, rule lookup included */
+	uint64_t latency[STATS_BUCKETS];
+};
+
+struct thread_stats {
+	uint64_t tid;
+	struct call_stats calls[CALL_COUNT];
+} __attribute__((aligned(64)));
+
+struct stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	/* Slots handed out so far; threads beyond STATS_MAX_THREADS share the last one */
+	uint32_t threads;
+	struct thread_stats slots[STATS_MAX_THREADS];
+};
+
+#define STATS_NAME_FORMAT "/protect.%d"
+
+#endif
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Throughput benchmarks for rhasher, run by CTest under the benchmark label.
+#
+#   bench.sh strings      commands/s for short quoted strings in batch mode
+#   bench.sh repl         commands/s of the plain REPL on a scripted stdin
+#   bench.sh files SIZE…  MB/s for files of each size (as understood by
+#                         numfmt, e.g. 4K 1M 8G)
+#
+# Every algorithm is measured separately. Results are printed and appended
+# to $LOG as tab separated lines: time, commit, benchmark, algorithm, input,
+# metric, value, so runs of different commits can be compared.
+
+RHASHER=${RHASHER:-./rhasher}
+LOG=${LOG:-benchmark.tsv}
+COMMANDS=${COMMANDS:-100000}
+# Bytes hashed per measurement at least, by repeating small files
+FILE_BYTES=${FILE_BYTES:-67108864}
+ALGS=${ALGS:-"MD5 SHA1 TTH"}
+COMMIT=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo -)
+
+now() {
+	date +%s%N
+}
+
+record() {
+	echo "$1 $2 $3: $5 $4"
+	printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\n' "$(date +%s)" "$COMMIT" "$1" "$2" "$3" "$4" "$5" >> "$LOG"
+}
+
+per_second() {
+	awk -v n="$1" -v ns="$2" 'BEGIN { printf "%.1f", n / (ns / 1e9) }'
+}
+
+commands() {
+	mode=$1
+	shift
+	for alg in $ALGS; do
+		awk -v alg="$alg" -v n="$COMMANDS" 'BEGIN { for (i = 0; i < n; i++) printf "%s \"string%d\"\n", alg, i }' > bench.commands
+		start=$(now)
+		"$RHASHER" "$@" < bench.commands > bench.out || return 1
+		end=$(now)
+		[ "$(wc -l < bench.out)" -eq "$COMMANDS" ] || return 1
+		record "$mode" "$alg" "${COMMANDS}x" commands/s "$(per_second "$COMMANDS" $((end - start)))"
+	done
+	rm -f bench.commands bench.out
+}
+
+files() {
+	for size in "$@"; do
+		bytes=$(numfmt --from=iec "$size") || return 1
+		head -c "$bytes" /dev/urandom > bench.bin
+		# Small files are hashed repeatedly in one run so that start-up does not dominate
+		repeat=$((FILE_BYTES / bytes))
+		[ $repeat -gt 0 ] || repeat=1
+		for alg in $ALGS; do
+			awk -v alg="$alg" -v n=$repeat 'BEGIN { for (i = 0; i < n; i++) print alg " bench.bin" }' > bench.commands
+			# The first pass brings the file into the page cache
+			echo "$alg bench.bin" | "$RHASHER" > /dev/null || return 1
+			start=$(now)
+			"$RHASHER" --batch -j 1 < bench.commands > /dev/null || return 1
+			end=$(now)
+			record files "$alg" "$size" MB/s "$(awk -v b=$((bytes * repeat)) -v ns=$((end - start)) 'BEGIN { printf "%.1f", b / 1e6 / (ns / 1e9) }')"
+		done
+	done
+	rm -f bench.bin bench.commands
+}
+
+case "$1" in
+	strings)
+		commands strings --batch -j 1
+		;;
+	repl)
+		commands repl
+		;;
+	files)
+		shift
+		[ $# -gt 0 ] || set -- 4K 64K 1M 16M 256M 1G 8G
+		files "$@"
+		;;
+	*)
+		echo "Usage: $0 strings|repl|files [size...]" >&2
+		exit 1
+		;;
+esac
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "cache.h"
+
+#define CACHE_MAGIC 0x48435352u /* "RSCH" */
+
+/*
+ * On-disk record. Appends are written with a single write() under an
+ * exclusive flock, so readers holding a shared lock never see half of one.
+ * The checksum catches records damaged in any other way.
+ */
+struct cache_record {
+    uint32_t magic;
+    uint32_t alg;
+    struct cache_key key;
+    uint32_t digest_size;
+    uint32_t check;
+    unsigned char digest[CACHE_MAX_DIGEST];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    off_t loaded;
+    /* Open addressing by (dev, ino, alg); a later record replaces an older one */
+    struct cache_record* table;
+    size_t capacity;
+    size_t count;
+} cache = {PTHREAD_MUTEX_INITIALIZER, -1};
+
+static uint32_t record_check(const struct cache_record* record) {
+    struct cache_record copy = *record;
+    copy.check = 0;
+    const unsigned char* bytes = (const unsigned char*)&copy;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(copy); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static size_t slot_of(uint64_t dev, uint64_t ino, unsigned alg) {
+    uint64_t hash = (ino * 0x9E3779B97F4A7C15ull) ^ (dev * 0xC2B2AE3D27D4EB4Full) ^ alg;
+    hash ^= hash >> 29;
+    return hash & (cache.capacity - 1);
+}
+
+static struct cache_record* find_slot(uint64_t dev, uint64_t ino, unsigned alg) {
+    size_t i = slot_of(dev, ino, alg);
+    for (;;) {
+        struct cache_record* slot = &cache.table[i];
+        if (slot->magic == 0 || (slot->key.dev == dev && slot->key.ino == ino && slot->alg == alg))
+            return slot;
+        i = (i + 1) & (cache.capacity - 1);
+    }
+}
+
+static int insert(const struct cache_record* record) {
+    if ((cache.count + 1) * 2 > cache.capacity) {
+        size_t old_capacity = cache.capacity;
+        struct cache_record* old = cache.table;
+        size_t capacity = old_capacity ? old_capacity * 2 : 1024;
+        struct cache_record* table = calloc(capacity, sizeof(*table));
+        if (!table)
+            return -1;
+        cache.table = table;
+        cache.capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i].magic)
+                *find_slot(old[i].key.dev, old[i].key.ino, old[i].alg) = old[i];
+        free(old);
+    }
+    struct cache_record* slot = find_slot(record->key.dev, record->key.ino, record->alg);
+    if (slot->magic == 0)
+        cache.count++;
+    *slot = *record;
+    return 0;
+}
+
+/* Pick up records appended since the last call, by this or another process */
+static void load_new_records(void) {
+    struct stat st;
+    if (fstat(cache.fd, &st) == -1 || st.st_size <= cache.loaded)
+        return;
+    flock(cache.fd, LOCK_SH);
+    struct cache_record record;
+    while (pread(cache.fd, &record, sizeof(record), cache.loaded) == sizeof(record)) {
+        cache.loaded += sizeof(record);
+        if (record.magic == CACHE_MAGIC && record.digest_size <= CACHE_MAX_DIGEST &&
+                record.check == record_check(&record))
+            insert(&record);
+    }
+    flock(cache.fd, LOCK_UN);
+}
+
+void cache_key_from_stat(const struct stat* st, struct cache_key* key) {
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int cache_open(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    /* A writer that died mid-record would shift every later append, so cut it off */
+    struct stat st;
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0 && st.st_size % sizeof(struct cache_record) != 0)
+        if (ftruncate(fd, st.st_size - st.st_size % sizeof(struct cache_record)) == -1) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    flock(fd, LOCK_UN);
+    cache.fd = fd;
+    cache.loaded = 0;
+    load_new_records();
+    return 0;
+}
+
+void cache_close(void) {
+    if (cache.fd != -1)
+        close(cache.fd);
+    cache.fd = -1;
+    free(cache.table);
+    cache.table = NULL;
+    cache.capacity = 0;
+    cache.count = 0;
+}
+
+static size_t lookup_loaded(const struct cache_key* key, unsigned alg, unsigned char* digest) {
+    if (cache.capacity == 0)
+        return 0;
+    const struct cache_record* slot = find_slot(key->dev, key->ino, alg);
+    if (slot->magic == 0 || slot->key.size != key->size || slot->key.mtime_ns != key->mtime_ns)
+        return 0;
+    memcpy(digest, slot->digest, slot->digest_size);
+    return slot->digest_size;
+}
+
+size_t cache_lookup(const struct cache_key* key, unsigned alg, unsigned char* digest) {
+    pthread_mutex_lock(&cache.lock);
+    size_t size = lookup_loaded(key, alg, digest);
+    if (size == 0 && cache.fd != -1) {
+        load_new_records();
+        size = lookup_loaded(key, alg, digest);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return size;
+}
+
+void cache_store(const struct cache_key* key, unsigned alg, const unsigned char* digest, size_t size) {
+    if (size > CACHE_MAX_DIGEST)
+        return;
+    struct cache_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CACHE_MAGIC;
+    record.alg = alg;
+    record.key = *key;
+    record.digest_size = size;
+    memcpy(record.digest, digest, size);
+    record.check = record_check(&record);
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.fd != -1) {
+        struct stat st;
+        flock(cache.fd, LOCK_EX);
+        ssize_t written = -1;
+        if (fstat(cache.fd, &st) == 0) {
+            written = write(cache.fd, &record, sizeof(record));
+            /* Never leave a partial record for the next append to land after */
+            if (written != -1 && written != sizeof(record) && ftruncate(cache.fd, st.st_size) == -1)
+                written = -1;
+        }
+        flock(cache.fd, LOCK_UN);
+        if (written == sizeof(record))
+            insert(&record);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
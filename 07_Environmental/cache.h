@@ -0,0 +1,34 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Persistent digest cache: an append-only log of fixed-size records shared
+ * by every rhasher process that opens the same file. A digest is reused
+ * only while the device, inode, size and mtime of the file are unchanged.
+ */
+
+/* Largest digest librhash produces, in bytes */
+#define CACHE_MAX_DIGEST 64
+
+struct cache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+void cache_key_from_stat(const struct stat* st, struct cache_key* key);
+
+/* Returns 0, or -1 with errno set if the log can not be opened */
+int cache_open(const char* path);
+void cache_close(void);
+
+/* Copies a cached digest of the algorithm; returns its size, or 0 on a miss */
+size_t cache_lookup(const struct cache_key* key, unsigned alg, unsigned char* digest);
+void cache_store(const struct cache_key* key, unsigned alg, const unsigned char* digest, size_t size);
+
+#endif
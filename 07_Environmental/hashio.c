@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashio.h"
+
+int io_method_parse(const char* name) {
+    if (strcmp(name, "read") == 0) return IO_READ;
+    if (strcmp(name, "direct") == 0) return IO_DIRECT;
+    if (strcmp(name, "mmap") == 0) return IO_MMAP;
+    return -1;
+}
+
+/* Fill a whole block unless the file ends first; O_DIRECT needs aligned offsets */
+static ssize_t read_block(int fd, unsigned char* buffer) {
+    size_t done = 0;
+    while (done < IO_BLOCK_SIZE) {
+        ssize_t n = read(fd, buffer + done, IO_BLOCK_SIZE - done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* Two buffers per hashing thread, kept for the next file and lent to its reader */
+static __thread unsigned char* buffers[2];
+/* Its destructor frees the buffers when a pool thread exits */
+static pthread_key_t buffers_key;
+static pthread_once_t buffers_once = PTHREAD_ONCE_INIT;
+
+static void free_buffers(void* arg) {
+    (void)arg;
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i]);
+        buffers[i] = NULL;
+    }
+}
+
+static void create_buffers_key(void) {
+    pthread_key_create(&buffers_key, free_buffers);
+}
+
+static int get_buffers(void) {
+    if (!buffers[0]) {
+        pthread_once(&buffers_once, create_buffers_key);
+        /* Any non-NULL value makes the destructor run */
+        pthread_setspecific(buffers_key, buffers);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!buffers[i] && posix_memalign((void**)&buffers[i], IO_ALIGN, IO_BLOCK_SIZE) != 0) {
+            buffers[i] = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The reader fills one buffer while the caller hashes the other. A length
+ * of 0 marks the end of the file and -1 a read error.
+ */
+struct reader {
+    int fd;
+    int tee_fd;
+    int use_tee;
+    unsigned char* buffer[2];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    ssize_t len[2];
+    int full[2];
+    int error;
+};
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * With a tee target data is passed on as soon as it arrives, not a block
+ * at a time. Between two pipes tee(2) duplicates it without a copy, and
+ * only the hashing side is read.
+ */
+static ssize_t fill_block(struct reader* reader, unsigned char* buffer) {
+    if (reader->tee_fd == -1)
+        return read_block(reader->fd, buffer);
+    ssize_t n;
+    if (reader->use_tee) {
+        do
+            n = tee(reader->fd, reader->tee_fd, IO_BLOCK_SIZE, 0);
+        while (n == -1 && errno == EINTR);
+        if (n == -1 && errno == EINVAL) {
+            reader->use_tee = 0;
+        } else {
+            size_t done = 0;
+            while (n > 0 && done < (size_t)n) {
+                ssize_t part = read(reader->fd, buffer + done, n - done);
+                if (part == -1 && errno == EINTR)
+                    continue;
+                if (part <= 0)
+                    return -1;
+                done += part;
+            }
+            return n;
+        }
+    }
+    do
+        n = read(reader->fd, buffer, IO_BLOCK_SIZE);
+    while (n == -1 && errno == EINTR);
+    if (n > 0 && write_all(reader->tee_fd, buffer, n) == -1)
+        return -1;
+    return n;
+}
+
+static void* reader_thread(void* arg) {
+    struct reader* reader = arg;
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full[i])
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        pthread_mutex_unlock(&reader->lock);
+
+        ssize_t n = fill_block(reader, reader->buffer[i]);
+        int error = errno;
+        pthread_mutex_lock(&reader->lock);
+        reader->len[i] = n;
+        reader->error = error;
+        reader->full[i] = 1;
+        pthread_cond_signal(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (n <= 0)
+            return NULL;
+    }
+}
+
+static int hash_prefetched(rhash ctx, int fd, int tee_fd) {
+    struct reader reader = {
+        .fd = fd,
+        .tee_fd = tee_fd,
+        .use_tee = 1,
+        .buffer = {buffers[0], buffers[1]},
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+    };
+    pthread_t thread;
+    int res = pthread_create(&thread, NULL, reader_thread, &reader);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+
+    res = 0;
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&reader.lock);
+        while (!reader.full[i])
+            pthread_cond_wait(&reader.changed, &reader.lock);
+        ssize_t n = reader.len[i];
+        pthread_mutex_unlock(&reader.lock);
+        if (n <= 0) {
+            if (n == -1) {
+                res = -1;
+                errno = reader.error;
+            }
+            break;
+        }
+        rhash_update(ctx, buffers[i], n);
+        pthread_mutex_lock(&reader.lock);
+        reader.full[i] = 0;
+        pthread_cond_signal(&reader.changed);
+        pthread_mutex_unlock(&reader.lock);
+    }
+    pthread_join(thread, NULL);
+    return res;
+}
+
+static int hash_read(rhash ctx, int fd, const struct stat* st) {
+    if (get_buffers() == -1)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    /* A file that fits one block gains nothing from a second thread */
+    if (S_ISREG(st->st_mode) && st->st_size <= IO_BLOCK_SIZE) {
+        ssize_t n = read_block(fd, buffers[0]);
+        if (n == -1)
+            return -1;
+        rhash_update(ctx, buffers[0], n);
+        if (n < IO_BLOCK_SIZE)
+            return 0;
+    }
+    return hash_prefetched(ctx, fd, -1);
+}
+
+static int hash_mapped(rhash ctx, int fd, const struct stat* st) {
+    if (st->st_size == 0)
+        return 0;
+    unsigned char* data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+    for (off_t pos = 0; pos < st->st_size; pos += IO_BLOCK_SIZE) {
+        size_t len = st->st_size - pos < IO_BLOCK_SIZE ? st->st_size - pos : IO_BLOCK_SIZE;
+        rhash_update(ctx, data + pos, len);
+        /* Hashed pages are not needed again, keep them from crowding out readahead */
+        if (pos >= IO_BLOCK_SIZE)
+            madvise(data + pos - IO_BLOCK_SIZE, IO_BLOCK_SIZE, MADV_DONTNEED);
+    }
+    munmap(data, st->st_size);
+    return 0;
+}
+
+int io_hash_file(rhash ctx, const char* filename, enum io_method method) {
+    return io_hash_at(ctx, AT_FDCWD, filename, method);
+}
+
+int io_hash_at(rhash ctx, int dirfd, const char* name, enum io_method method) {
+    int fd = -1;
+    if (method == IO_DIRECT) {
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECT);
+        /* Not every filesystem supports O_DIRECT, buffered reads still work there */
+        if (fd == -1 && errno == EINVAL)
+            method = IO_READ;
+        else if (fd == -1)
+            return -1;
+    }
+    if (fd == -1)
+        fd = openat(dirfd, name, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    int res = fstat(fd, &st);
+    if (res == 0) {
+        if (method == IO_MMAP && S_ISREG(st.st_mode))
+            res = hash_mapped(ctx, fd, &st);
+        else
+            res = hash_read(ctx, fd, &st);
+    }
+    int error = errno;
+    close(fd);
+    errno = error;
+    return res;
+}
+
+int io_hash_stream(rhash ctx, int fd, int tee_fd) {
+    if (get_buffers() == -1)
+        return -1;
+    return hash_prefetched(ctx, fd, tee_fd);
+}
+
+int io_hash_range(rhash ctx, int fd, off_t offset, off_t len) {
+    if (get_buffers() == -1)
+        return -1;
+    while (len > 0) {
+        ssize_t n = pread(fd, buffers[0], len < IO_BLOCK_SIZE ? len : IO_BLOCK_SIZE, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        rhash_update(ctx, buffers[0], n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
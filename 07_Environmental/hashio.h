@@ -0,0 +1,30 @@
+#ifndef HASHIO_H
+#define HASHIO_H
+
+#include <sys/types.h>
+#include "rhash.h"
+
+/* How file data is brought in before it is passed to rhash_update */
+enum io_method {
+    IO_READ,    /* large aligned reads, prefetched by a reader thread */
+    IO_DIRECT,  /* the same with O_DIRECT, bypassing the page cache */
+    IO_MMAP     /* the whole file mapped with sequential access hints */
+};
+
+/* Bytes handed to rhash_update at a time; a multiple of any O_DIRECT alignment */
+#define IO_BLOCK_SIZE (1 << 20)
+#define IO_ALIGN 4096
+
+/* Parses "read", "direct" or "mmap"; returns -1 for anything else */
+int io_method_parse(const char* name);
+
+/* Feeds the whole file to ctx; returns 0, or -1 with errno set */
+int io_hash_file(rhash ctx, const char* filename, enum io_method method);
+/* The same for a name relative to an open directory */
+int io_hash_at(rhash ctx, int dirfd, const char* name, enum io_method method);
+/* Feeds a pipe or other stream to its end, copying the data to tee_fd unless it is -1 */
+int io_hash_stream(rhash ctx, int fd, int tee_fd);
+/* Feeds len bytes from offset, or up to the end of the file, with pread */
+int io_hash_range(rhash ctx, int fd, off_t offset, off_t len);
+
+#endif
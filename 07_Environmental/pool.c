@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "pool.h"
+
+struct pool_task {
+    pool_job job;
+    void* arg;
+    struct pool_task* prev;
+    struct pool_task* next;
+};
+
+/* Owners push and pop at the bottom, thieves take the oldest task from the top */
+struct deque {
+    pthread_mutex_t lock;
+    struct pool_task* top;
+    struct pool_task* bottom;
+};
+
+struct pool_worker {
+    struct pool* pool;
+    int index;
+    struct deque deque;
+    pthread_t thread;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    /* Tasks sitting in a deque, and tasks submitted but not yet finished */
+    long queued;
+    long pending;
+    int closed;
+    /* Workers allocated, and threads actually started */
+    int size;
+    int count;
+    /* Jobs submitted from outside the pool, run in FIFO order */
+    struct deque shared;
+    struct pool_worker* workers;
+};
+
+static __thread struct pool_worker* current;
+
+static void deque_init(struct deque* deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->top = deque->bottom = NULL;
+}
+
+static void deque_push(struct deque* deque, struct pool_task* task) {
+    pthread_mutex_lock(&deque->lock);
+    task->next = NULL;
+    task->prev = deque->bottom;
+    if (deque->bottom)
+        deque->bottom->next = task;
+    else
+        deque->top = task;
+    deque->bottom = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static struct pool_task* deque_pop_bottom(struct deque* deque) {
+    pthread_mutex_lock(&deque->lock);
+    struct pool_task* task = deque->bottom;
+    if (task) {
+        deque->bottom = task->prev;
+        if (deque->bottom)
+            deque->bottom->next = NULL;
+        else
+            deque->top = NULL;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static struct pool_task* deque_pop_top(struct deque* deque) {
+    pthread_mutex_lock(&deque->lock);
+    struct pool_task* task = deque->top;
+    if (task) {
+        deque->top = task->next;
+        if (deque->top)
+            deque->top->prev = NULL;
+        else
+            deque->bottom = NULL;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/* Own newest task first, then the shared queue, then the oldest task of another worker */
+static struct pool_task* find_task(struct pool_worker* self) {
+    struct pool* pool = self->pool;
+    struct pool_task* task = deque_pop_bottom(&self->deque);
+    if (!task)
+        task = deque_pop_top(&pool->shared);
+    for (int i = 1; !task && i < pool->size; i++)
+        task = deque_pop_top(&pool->workers[(self->index + i) % pool->size].deque);
+    return task;
+}
+
+static void* pool_worker(void* arg) {
+    struct pool_worker* self = arg;
+    struct pool* pool = self->pool;
+    current = self;
+    for (;;) {
+        struct pool_task* task = find_task(self);
+        if (task) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            task->job(task->arg);
+            free(task);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0)
+                pthread_cond_broadcast(&pool->ready);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !(pool->closed && pool->pending == 0))
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        int done = pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (done)
+            return NULL;
+    }
+}
+
+struct pool* pool_create(int workers) {
+    struct pool* pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    deque_init(&pool->shared);
+    pool->size = workers;
+    for (int i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        deque_init(&pool->workers[i].deque);
+    }
+    while (pool->count < workers &&
+           !pthread_create(&pool->workers[pool->count].thread, NULL, pool_worker, &pool->workers[pool->count]))
+        pool->count++;
+    if (pool->count == 0) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void pool_submit(struct pool* pool, pool_job job, void* arg) {
+    struct pool_task* task = malloc(sizeof(*task));
+    if (!task) {
+        /* Nothing to queue the job with, so run it right here */
+        job(arg);
+        return;
+    }
+    task->job = job;
+    task->arg = arg;
+    /* Counted before it becomes visible, so pending can not drop to zero under a running parent */
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+    if (current && current->pool == pool)
+        deque_push(&current->deque, task);
+    else
+        deque_push(&pool->shared, task);
+    pthread_cond_signal(&pool->ready);
+}
+
+void pool_destroy(struct pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->shared.lock);
+    for (int i = 0; i < pool->size; i++)
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    free(pool->workers);
+    free(pool);
+}
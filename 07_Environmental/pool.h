@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * Fixed set of worker threads. Jobs submitted from outside the pool run in
+ * FIFO order; a job submitted by a running job goes to that worker's own
+ * deque, which it works through newest first while idle workers steal the
+ * oldest entries.
+ */
+
+typedef void (*pool_job)(void* arg);
+
+struct pool;
+
+struct pool* pool_create(int workers);
+void pool_submit(struct pool* pool, pool_job job, void* arg);
+/* Waits for every submitted job, including jobs they submit, then stops the workers */
+void pool_destroy(struct pool* pool);
+
+#endif
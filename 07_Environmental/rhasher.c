@@ -3,8 +3,21 @@
 #include "rhash.h"
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "hashio.h"
+#include "pool.h"
+#include "tree.h"
 
+#ifdef USE_READLINE
 #define READLINE_AVAILABLE
+#endif
 
 #ifdef READLINE_AVAILABLE
 #include <readline/readline.h>
@@ -39,116 +52,1055 @@ int get_alg_id (const char* alg_name) {
 
 #define UNKNOWN_COMMAND 100
 #define HASH_FAILED 101
+#define CORRUPTED_STRING 102
+#define CACHE_MISMATCH 103
+#define CHUNK_CHANGED 104
+#define STDIN_BUSY 105
 
-int hash_string (const char* alg_name, char* input) {
-    rhash_library_init();
-    int alg_id = get_alg_id(alg_name);
-    if (alg_id == -1) return UNKNOWN_COMMAND;
+/* Most algorithms one command may combine, as in MD5+SHA1+TTH */
+#define MAX_ALGS 8
+/* Large enough for MAX_ALGS digests printed in hex or base64 */
+#define OUTPUT_SIZE 1024
+/* Results that may be in flight ahead of the next one to print in batch mode */
+#define REORDER_WINDOW 4096
 
-    unsigned char digest[64];
-    char output[130];
-    int res = rhash_msg(alg_id, input, strlen(input), digest);
-    if (res < 0) return HASH_FAILED;
+struct alg_list {
+    int count;
+    unsigned mask;
+    unsigned ids[MAX_ALGS];
+    int modes[MAX_ALGS];
+};
 
-    int output_mode = isupper((unsigned char)alg_name[0]) ? RHPR_HEX : RHPR_BASE64;
-    rhash_print_bytes(output, digest, rhash_get_digest_size(alg_id), output_mode);
-    fprintf(stdout, "%s\n", output);
+/* Parse "MD5+sha1+TTH"; lowercase names are printed in base64, others in hex */
+int parse_algs (const char* spec, struct alg_list* algs) {
+    algs->count = 0;
+    algs->mask = 0;
+    const char* name = spec;
+    while (*name) {
+        size_t len = strcspn(name, "+");
+        char single[16];
+        if (len == 0 || len >= sizeof(single) || algs->count == MAX_ALGS)
+            return UNKNOWN_COMMAND;
+        memcpy(single, name, len);
+        single[len] = '\0';
+        int alg_id = get_alg_id(single);
+        if (alg_id == -1) return UNKNOWN_COMMAND;
+        algs->ids[algs->count] = alg_id;
+        algs->modes[algs->count] = isupper((unsigned char)single[0]) ? RHPR_HEX : RHPR_BASE64;
+        algs->count++;
+        algs->mask |= alg_id;
+        name += len;
+        if (*name == '+')
+            name++;
+    }
+    return algs->count ? 0 : UNKNOWN_COMMAND;
+}
+
+/* Print every requested digest, space separated, each in the mode of its name */
+static void format_digests (const struct alg_list* algs, unsigned char digests[][CACHE_MAX_DIGEST], char* output) {
+    size_t pos = 0;
+    for (int i = 0; i < algs->count; i++) {
+        if (i)
+            output[pos++] = ' ';
+        pos += rhash_print_bytes(output + pos, digests[i], rhash_get_digest_size(algs->ids[i]), algs->modes[i]);
+    }
+    output[pos] = '\0';
+}
+
+static void final_digests (rhash ctx, const struct alg_list* algs, unsigned char digests[][CACHE_MAX_DIGEST]) {
+    rhash_final(ctx, NULL);
+    for (int i = 0; i < algs->count; i++)
+        rhash_print((char*)digests[i], ctx, algs->ids[i], RHPR_RAW);
+}
+
+int hash_string (const char* alg_spec, const char* input, char* output) {
+    struct alg_list algs;
+    unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+    if (parse_algs(alg_spec, &algs)) return UNKNOWN_COMMAND;
+
+    rhash ctx = rhash_init(algs.mask);
+    if (!ctx) return HASH_FAILED;
+    rhash_update(ctx, input, strlen(input));
+    final_digests(ctx, &algs, digests);
+    rhash_free(ctx);
+    format_digests(&algs, digests, output);
     return 0;
 }
 
-int hash_file(const char* alg_name, const char* filename) {
-    rhash_library_init();
-    int alg_id = get_alg_id(alg_name);
-    if (!alg_id) return UNKNOWN_COMMAND;
-    unsigned char digest[64];
-    char output[130];
-    int res = rhash_file(RHASH_TTH, filename, digest);
-    if (res < 0) return HASH_FAILED;
-    int output_mode = isupper((unsigned char)alg_name[0]) ? RHPR_HEX : RHPR_BASE64;
-    rhash_print_bytes(output, digest, rhash_get_digest_size(alg_id), output_mode);
-    printf("%s\n", output);
+static enum io_method io_method = IO_READ;
+
+enum cache_mode { CACHE_OFF, CACHE_USE, CACHE_BYPASS, CACHE_VERIFY };
+static enum cache_mode cache_mode = CACHE_OFF;
+
+/* All digests of the command from the cache, or 0 if any of them is missing */
+static int cached_digests (const struct cache_key* key, const struct alg_list* algs, unsigned char digests[][CACHE_MAX_DIGEST]) {
+    for (int i = 0; i < algs->count; i++)
+        if (cache_lookup(key, algs->ids[i], digests[i]) != rhash_get_digest_size(algs->ids[i]))
+            return 0;
+    return 1;
+}
+
+/*
+ * Digests are stored only if the file looked the same before and after
+ * hashing; in verify mode a stored digest that disagrees is reported.
+ */
+static int update_cache (int dirfd, const char* name, const struct cache_key* key, const struct alg_list* algs, unsigned char digests[][CACHE_MAX_DIGEST]) {
+    struct stat st;
+    struct cache_key after;
+    if (fstatat(dirfd, name, &st, 0) == -1)
+        return 0;
+    cache_key_from_stat(&st, &after);
+    if (memcmp(key, &after, sizeof(after)) != 0)
+        return 0;
+    int res = 0;
+    for (int i = 0; i < algs->count; i++) {
+        size_t size = rhash_get_digest_size(algs->ids[i]);
+        unsigned char cached[CACHE_MAX_DIGEST];
+        if (cache_mode == CACHE_VERIFY && cache_lookup(key, algs->ids[i], cached) == size) {
+            if (memcmp(cached, digests[i], size) == 0)
+                continue;
+            res = CACHE_MISMATCH;
+        }
+        cache_store(key, algs->ids[i], digests[i], size);
+    }
+    return res;
+}
+
+/* Every algorithm of the command is computed from one pass over the file */
+static int hash_at (const struct alg_list* algs, int dirfd, const char* name, unsigned char digests[][CACHE_MAX_DIGEST]) {
+    struct cache_key key;
+    if (cache_mode != CACHE_OFF) {
+        struct stat st;
+        if (fstatat(dirfd, name, &st, 0) == -1) return HASH_FAILED;
+        cache_key_from_stat(&st, &key);
+        if (cache_mode == CACHE_USE && S_ISREG(st.st_mode) && cached_digests(&key, algs, digests))
+            return 0;
+    }
+
+    rhash ctx = rhash_init(algs->mask);
+    if (!ctx) return HASH_FAILED;
+    if (io_hash_at(ctx, dirfd, name, io_method) == -1) {
+        rhash_free(ctx);
+        return HASH_FAILED;
+    }
+    final_digests(ctx, algs, digests);
+    rhash_free(ctx);
+    if (cache_mode != CACHE_OFF)
+        return update_cache(dirfd, name, &key, algs, digests);
     return 0;
 }
 
-int main (int argc, char** argv) {
-    if (argc > 1) {
-        fprintf(stderr, "Incorrect usage.\n");
-        return 1;
+/* Set when the commands themselves are read from stdin, so "-" can not be hashed */
+static int stdin_commands = 1;
+static int tee_stdin = 0;
+
+/* Stream stdin in large blocks, optionally passing it on to stdout */
+static int hash_stdin (const struct alg_list* algs, unsigned char digests[][CACHE_MAX_DIGEST]) {
+    if (stdin_commands) return STDIN_BUSY;
+    rhash ctx = rhash_init(algs->mask);
+    if (!ctx) return HASH_FAILED;
+    if (io_hash_stream(ctx, STDIN_FILENO, tee_stdin ? STDOUT_FILENO : -1) == -1) {
+        rhash_free(ctx);
+        return HASH_FAILED;
     }
-#ifdef READLINE_AVAILABLE
-    char* line;
-    
-    while ((line = readline("> ")) != NULL) {
-        if (strlen(line) == 0) {
-            free(line);
+    final_digests(ctx, algs, digests);
+    rhash_free(ctx);
+    return 0;
+}
+
+int hash_file(const char* alg_spec, const char* filename, char* output) {
+    struct alg_list algs;
+    unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+    if (parse_algs(alg_spec, &algs)) return UNKNOWN_COMMAND;
+    int res = strcmp(filename, "-") == 0 ? hash_stdin(&algs, digests) : hash_at(&algs, AT_FDCWD, filename, digests);
+    if (res == 0 || res == CACHE_MISMATCH)
+        format_digests(&algs, digests, output);
+    return res;
+}
+
+/* Hash a quoted string token or a named file, as typed after the algorithm name */
+int hash_target(const char* alg_name, const char* input, char* output) {
+    if (!is_string(input))
+        return hash_file(alg_name, input, output);
+    char* str_content = extract_string(input);
+    if (str_content == NULL)
+        return CORRUPTED_STRING;
+    int res = hash_string(alg_name, str_content, output);
+    free(str_content);
+    return res;
+}
+
+static long jobs = 1;
+static int tree_digest_wanted = 0;
+
+static int is_directory (const char* input) {
+    struct stat st;
+    return !is_string(input) && stat(input, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int hash_tree_file (int dirfd, const char* name, unsigned char* digests, void* arg) {
+    return hash_at(arg, dirfd, name, (unsigned char (*)[CACHE_MAX_DIGEST])digests);
+}
+
+/*
+ * Merkle digest of the sorted entries that share a path prefix: each child
+ * adds its kind ('f' or 'd'), its name with a terminating NUL and its digest,
+ * a subdirectory being summarized the same way first. Directories without
+ * regular files below them do not take part.
+ */
+static void tree_digest (const struct tree* tree, size_t begin, size_t end, size_t prefix_len,
+                         int alg, unsigned id, unsigned char* digest) {
+    size_t size = rhash_get_digest_size(id);
+    rhash ctx = rhash_init(id);
+    for (size_t i = begin; i < end;) {
+        const char* name = tree->entries[i].path + prefix_len;
+        const char* slash = strchr(name, '/');
+        if (!slash) {
+            rhash_update(ctx, "f", 1);
+            rhash_update(ctx, name, strlen(name) + 1);
+            rhash_update(ctx, tree->entries[i].digests + alg * CACHE_MAX_DIGEST, size);
+            i++;
+            continue;
+        }
+        size_t len = slash - name + 1;
+        size_t j = i;
+        while (j < end && strncmp(tree->entries[j].path + prefix_len, name, len) == 0)
+            j++;
+        unsigned char child[CACHE_MAX_DIGEST];
+        tree_digest(tree, i, j, prefix_len + len, alg, id, child);
+        rhash_update(ctx, "d", 1);
+        rhash_update(ctx, name, len - 1);
+        rhash_update(ctx, "", 1);
+        rhash_update(ctx, child, size);
+        i = j;
+    }
+    rhash_final(ctx, NULL);
+    rhash_print((char*)digest, ctx, id, RHPR_RAW);
+    rhash_free(ctx);
+}
+
+/*
+ * Hash every regular file below a directory and print "digests  path" lines
+ * in path order, optionally followed by the tree digest as "digests  dir/".
+ * Failures are reported on stderr as they are met.
+ */
+int hash_tree (const char* alg_spec, const char* root, FILE* out) {
+    struct alg_list algs;
+    struct tree tree;
+    if (parse_algs(alg_spec, &algs)) return UNKNOWN_COMMAND;
+    if (tree_walk(root, jobs, sizeof(unsigned char[MAX_ALGS][CACHE_MAX_DIGEST]), hash_tree_file, &algs, &tree) == -1)
+        return HASH_FAILED;
+
+    size_t len = strlen(root);
+    const char* separator = len && root[len - 1] == '/' ? "" : "/";
+    int res = tree.errors ? HASH_FAILED : 0;
+    char output[OUTPUT_SIZE];
+    for (size_t i = 0; i < tree.count; i++) {
+        struct tree_entry* entry = &tree.entries[i];
+        if (entry->status == 0 || entry->status == CACHE_MISMATCH) {
+            format_digests(&algs, (unsigned char (*)[CACHE_MAX_DIGEST])entry->digests, output);
+            fprintf(out, "%s  %s%s%s\n", output, root, separator, entry->path);
+        }
+        if (entry->status == CACHE_MISMATCH) {
+            fprintf(stderr, "Cached digest mismatch for %s%s%s\n", root, separator, entry->path);
+            res = HASH_FAILED;
+        } else if (entry->status != 0) {
+            fprintf(stderr, "Message digest calculation error for %s%s%s\n", root, separator, entry->path);
+            res = HASH_FAILED;
+        }
+    }
+    /* A tree digest that silently left files out would be worse than none */
+    if (tree_digest_wanted && res == 0) {
+        unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+        for (int i = 0; i < algs.count; i++)
+            tree_digest(&tree, 0, tree.count, 0, i, algs.ids[i], digests[i]);
+        format_digests(&algs, digests, output);
+        fprintf(out, "%s  %s%s\n", output, root, separator);
+    }
+    tree_free(&tree);
+    return res;
+}
+
+static off_t chunk_size = 0;
+static const char* chunk_list = NULL;
+
+struct chunk {
+    const struct alg_list* algs;
+    int fd;
+    off_t offset;
+    off_t len;
+    int status;
+    unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+};
+
+static void chunk_job (void* arg) {
+    struct chunk* chunk = arg;
+    rhash ctx = rhash_init(chunk->algs->mask);
+    if (!ctx) {
+        chunk->status = HASH_FAILED;
+        return;
+    }
+    chunk->status = io_hash_range(ctx, chunk->fd, chunk->offset, chunk->len) == -1 ? HASH_FAILED : 0;
+    final_digests(ctx, chunk->algs, chunk->digests);
+    rhash_free(ctx);
+}
+
+/*
+ * Binary hash tree over the chunk digests: a pair of nodes is combined as
+ * H(left || right) and an odd node at the end of a level moves up as is,
+ * so a file of a single chunk keeps its plain digest.
+ */
+static int chunk_tree_digest (const struct chunk* chunks, size_t count, int alg, unsigned id, unsigned char* digest) {
+    size_t size = rhash_get_digest_size(id);
+    unsigned char (*level)[CACHE_MAX_DIGEST] = malloc(count * sizeof(*level));
+    if (!level) return HASH_FAILED;
+    for (size_t i = 0; i < count; i++)
+        memcpy(level[i], chunks[i].digests[alg], size);
+    while (count > 1) {
+        size_t next = 0;
+        for (size_t i = 0; i < count; i += 2, next++) {
+            if (i + 1 == count) {
+                memmove(level[next], level[i], size);
+                continue;
+            }
+            rhash ctx = rhash_init(id);
+            rhash_update(ctx, level[i], size);
+            rhash_update(ctx, level[i + 1], size);
+            rhash_final(ctx, NULL);
+            rhash_print((char*)level[next], ctx, id, RHPR_RAW);
+            rhash_free(ctx);
+        }
+        count = next;
+    }
+    memcpy(digest, level[0], size);
+    free(level);
+    return 0;
+}
+
+/* Digest text of every chunk of the file found in a list printed by an earlier run */
+static char** load_chunk_list (const char* filename, size_t count) {
+    FILE* in = fopen(chunk_list, "r");
+    if (!in) return NULL;
+    char** known = calloc(count, sizeof(*known));
+    size_t name_len = strlen(filename);
+    char* line = NULL;
+    size_t len = 0;
+    while (known && getline(&line, &len, in) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char* separator = strstr(line, "  ");
+        if (!separator) continue;
+        const char* name = separator + 2;
+        if (strncmp(name, filename, name_len) != 0 || name[name_len] != '#') continue;
+        char* end;
+        unsigned long index = strtoul(name + name_len + 1, &end, 10);
+        if (*end == '\0' && index < count && !known[index])
+            known[index] = strndup(line, separator - line);
+    }
+    free(line);
+    fclose(in);
+    return known;
+}
+
+/*
+ * Hash a regular file in chunk_size pieces on the worker pool and print a
+ * "digests  file#N" line per chunk, then the tree digest as "digests  file".
+ * With a chunk list from an earlier run only changed chunks are printed;
+ * every chunk is still hashed, since a digest is the only way to tell.
+ */
+int hash_chunks (const char* alg_spec, const char* filename, FILE* out) {
+    struct alg_list algs;
+    struct stat st;
+    if (parse_algs(alg_spec, &algs)) return UNKNOWN_COMMAND;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Message digest calculation error for %s\n", filename);
+        if (fd != -1)
+            close(fd);
+        return HASH_FAILED;
+    }
+
+    size_t count = st.st_size ? (st.st_size + chunk_size - 1) / chunk_size : 1;
+    struct chunk* chunks = calloc(count, sizeof(*chunks));
+    struct pool* pool = chunks ? pool_create(jobs < (long)count ? jobs : (long)count) : NULL;
+    if (!pool) {
+        fprintf(stderr, "Message digest calculation error for %s\n", filename);
+        free(chunks);
+        close(fd);
+        return HASH_FAILED;
+    }
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].algs = &algs;
+        chunks[i].fd = fd;
+        chunks[i].offset = i * chunk_size;
+        chunks[i].len = chunk_size;
+        pool_submit(pool, chunk_job, &chunks[i]);
+    }
+    pool_destroy(pool);
+    close(fd);
+
+    char** known = NULL;
+    if (chunk_list && !(known = load_chunk_list(filename, count)))
+        fprintf(stderr, "Could not read chunk list %s\n", chunk_list);
+    int res = chunk_list && !known ? HASH_FAILED : 0;
+    int changed = 0;
+    char output[OUTPUT_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].status != 0) {
+            fprintf(stderr, "Message digest calculation error for %s#%zu\n", filename, i);
+            res = HASH_FAILED;
             continue;
         }
-        
-        add_history(line);
-#else
-    printf("> ");
+        format_digests(&algs, chunks[i].digests, output);
+        if (known) {
+            if (known[i] && strcmp(known[i], output) == 0)
+                continue;
+            fprintf(stderr, "Chunk %zu of %s changed\n", i, filename);
+            changed = 1;
+        }
+        fprintf(out, "%s  %s#%zu\n", output, filename, i);
+    }
+    if (res == 0) {
+        unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+        for (int i = 0; i < algs.count && res == 0; i++)
+            res = chunk_tree_digest(chunks, count, i, algs.ids[i], digests[i]);
+        if (res == 0) {
+            format_digests(&algs, digests, output);
+            fprintf(out, "%s  %s\n", output, filename);
+        }
+    }
+    if (known) {
+        for (size_t i = 0; i < count; i++)
+            free(known[i]);
+        free(known);
+    }
+    free(chunks);
+    return res ? res : changed ? CHUNK_CHANGED : 0;
+}
+
+/* Targets answered with a list of lines rather than a single digest */
+static int is_listing (const char* input) {
+    return is_directory(input) || (chunk_size > 0 && !is_string(input) && strcmp(input, "-") != 0);
+}
+
+static int hash_listing (const char* alg_spec, const char* input, FILE* out) {
+    if (is_directory(input))
+        return hash_tree(alg_spec, input, out);
+    return hash_chunks(alg_spec, input, out);
+}
+
+/* One input line of batch mode and, once a worker is done with it, its result */
+struct batch_slot {
+    long line_no;
+    char* line;
+    const char* alg_name;
+    const char* input;
+    int status;
+    int done;
+    char output[OUTPUT_SIZE];
+    /* Lines printed by a directory target */
+    char* listing;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    struct batch_slot slots[REORDER_WINDOW];
+} batch = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void batch_job(void* arg) {
+    struct batch_slot* slot = arg;
+    size_t size;
+    FILE* out;
+    slot->listing = NULL;
+    if (is_listing(slot->input) && (out = open_memstream(&slot->listing, &size)) != NULL) {
+        slot->status = hash_listing(slot->alg_name, slot->input, out);
+        fclose(out);
+    } else {
+        slot->status = hash_target(slot->alg_name, slot->input, slot->output);
+    }
+    pthread_mutex_lock(&batch.lock);
+    slot->done = 1;
+    pthread_cond_broadcast(&batch.finished);
+    pthread_mutex_unlock(&batch.lock);
+}
+
+/* Wait for the oldest result and print it, so output follows input order */
+static int batch_print(struct batch_slot* slot) {
+    pthread_mutex_lock(&batch.lock);
+    while (!slot->done)
+        pthread_cond_wait(&batch.finished, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    int failed = 1;
+    if (slot->listing) {
+        fputs(slot->listing, stdout);
+        free(slot->listing);
+        slot->listing = NULL;
+        if (slot->status == UNKNOWN_COMMAND)
+            fprintf(stderr, "Line %ld: Unknown command provided.\n", slot->line_no);
+        failed = slot->status != 0;
+    } else if (slot->status == 0) {
+        printf("%s  %s\n", slot->output, slot->input);
+        failed = 0;
+    } else if (slot->status == UNKNOWN_COMMAND) {
+        fprintf(stderr, "Line %ld: Unknown command provided.\n", slot->line_no);
+    } else if (slot->status == CACHE_MISMATCH) {
+        printf("%s  %s\n", slot->output, slot->input);
+        fprintf(stderr, "Line %ld: Cached digest mismatch for %s\n", slot->line_no, slot->input);
+    } else if (slot->status == STDIN_BUSY) {
+        fprintf(stderr, "Line %ld: Standard input already carries the commands.\n", slot->line_no);
+    } else if (slot->status == CORRUPTED_STRING) {
+        fprintf(stderr, "Line %ld: Corrupted string provided as input: %s.\n", slot->line_no, slot->input);
+    } else {
+        fprintf(stderr, "Line %ld: Message digest calculation error for %s\n", slot->line_no, slot->input);
+    }
+    free(slot->line);
+    slot->line = NULL;
+    return failed;
+}
+
+/*
+ * Non-interactive mode: every "ALG target" line is hashed on the worker
+ * pool, and results are printed in input order through a reorder window.
+ */
+int run_batch(FILE* input, int workers) {
+    struct pool* pool = pool_create(workers);
+    if (!pool) {
+        fprintf(stderr, "Could not start worker threads.\n");
+        return 1;
+    }
+    long submitted = 0;
+    long printed = 0;
+    long line_no = 0;
+    int failed = 0;
     char* line = NULL;
     size_t len = 0;
     ssize_t read;
-    
-    while ((read = getline(&line, &len, stdin)) != -1) {
-        if (read > 0 && line[read - 1] == '\n') {
+
+    while ((read = getline(&line, &len, input)) != -1) {
+        line_no++;
+        if (read > 0 && line[read - 1] == '\n')
             line[read - 1] = '\0';
-            read--;
-        }
-        
-        if (read == 0) {
-            printf("> ");
+        char* saveptr;
+        char* alg_name = strtok_r(line, " ", &saveptr);
+        if (alg_name == NULL)
+            continue;
+        char* target = strtok_r(NULL, " ", &saveptr);
+        if (target == NULL) {
+            fprintf(stderr, "Line %ld: Second parameter is missing.\n", line_no);
+            failed = 1;
             continue;
         }
+
+        if (submitted - printed == REORDER_WINDOW)
+            failed |= batch_print(&batch.slots[printed++ % REORDER_WINDOW]);
+        struct batch_slot* slot = &batch.slots[submitted++ % REORDER_WINDOW];
+        slot->line_no = line_no;
+        slot->line = line;
+        slot->alg_name = alg_name;
+        slot->input = target;
+        slot->done = 0;
+        pool_submit(pool, batch_job, slot);
+        line = NULL;
+        len = 0;
+    }
+    free(line);
+    while (printed < submitted)
+        failed |= batch_print(&batch.slots[printed++ % REORDER_WINDOW]);
+    pool_destroy(pool);
+    return failed;
+}
+
+/* One line of a checksum manifest and the outcome of checking it */
+struct check_entry {
+    char* name;
+    char digest[2 * CACHE_MAX_DIGEST + 1];
+    struct alg_list algs;
+    off_t size;
+    enum { CHECK_PENDING, CHECK_OK, CHECK_FAILED, CHECK_UNREADABLE, CHECK_SKIPPED } status;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int fail_fast;
+    int stop;
+    long long bytes;
+} check = {PTHREAD_MUTEX_INITIALIZER};
+
+/* The hex digest length tells which algorithm a md5sum-style line is for */
+static const char* alg_by_length (size_t len) {
+    if (len == 32) return "MD5";
+    if (len == 40) return "SHA1";
+    if (len == 48) return "TTH";
+    return NULL;
+}
+
+/*
+ * Accepts "digest  name", "digest *name" and the BSD "ALG (name) = digest"
+ * forms; returns 0 if the line is none of them.
+ */
+static int parse_check_line (char* line, struct check_entry* entry) {
+    line[strcspn(line, "\n")] = '\0';
+    const char* alg_name;
+    char* digest;
+    char* name;
+    char* open = strstr(line, " (");
+    char* close = strstr(line, ") = ");
+    if (open && close && close > open && open == line + strcspn(line, " ")) {
+        *open = '\0';
+        *close = '\0';
+        alg_name = line;
+        name = open + 2;
+        digest = close + 4;
+    } else {
+        size_t len = strspn(line, "0123456789abcdefABCDEF");
+        if (line[len] != ' ' || (line[len + 1] != ' ' && line[len + 1] != '*') || line[len + 2] == '\0')
+            return 0;
+        line[len] = '\0';
+        digest = line;
+        name = line + len + 2;
+        alg_name = alg_by_length(len);
+    }
+    if (!alg_name || parse_algs(alg_name, &entry->algs) || entry->algs.count != 1)
+        return 0;
+    size_t len = strlen(digest);
+    if (len != 2 * rhash_get_digest_size(entry->algs.ids[0]) || strspn(digest, "0123456789abcdefABCDEF") != len)
+        return 0;
+    for (size_t i = 0; i <= len; i++)
+        entry->digest[i] = tolower((unsigned char)digest[i]);
+    entry->name = strdup(name);
+    entry->status = CHECK_PENDING;
+    return entry->name != NULL;
+}
+
+static void check_job (void* arg) {
+    struct check_entry* entry = arg;
+    pthread_mutex_lock(&check.lock);
+    int stop = check.stop;
+    pthread_mutex_unlock(&check.lock);
+    if (stop) {
+        entry->status = CHECK_SKIPPED;
+        return;
+    }
+
+    unsigned char digests[MAX_ALGS][CACHE_MAX_DIGEST];
+    char actual[2 * CACHE_MAX_DIGEST + 1];
+    int res = hash_at(&entry->algs, AT_FDCWD, entry->name, digests);
+    if (res == 0 || res == CACHE_MISMATCH) {
+        rhash_print_bytes(actual, digests[0], rhash_get_digest_size(entry->algs.ids[0]), RHPR_HEX);
+        entry->status = strcmp(actual, entry->digest) == 0 ? CHECK_OK : CHECK_FAILED;
+    } else {
+        entry->status = CHECK_UNREADABLE;
+    }
+
+    pthread_mutex_lock(&check.lock);
+    if (entry->status == CHECK_OK) {
+        printf("%s: OK\n", entry->name);
+        check.bytes += entry->size;
+    } else {
+        printf("%s: FAILED%s\n", entry->name, entry->status == CHECK_UNREADABLE ? " open or read" : "");
+        if (check.fail_fast)
+            check.stop = 1;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&check.lock);
+}
+
+static int larger_first (const void* a, const void* b) {
+    off_t size_a = (*(struct check_entry* const*)a)->size;
+    off_t size_b = (*(struct check_entry* const*)b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+/*
+ * Verify a md5sum/sha1sum manifest: entries are checked on the worker pool,
+ * largest files first so that they do not end up running alone at the end.
+ * A status line is printed per file as it finishes, and a summary follows.
+ */
+int run_check (const char* manifest, int workers) {
+    FILE* input = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!input) {
+        fprintf(stderr, "Could not open %s\n", manifest);
+        return 1;
+    }
+    struct check_entry* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    long malformed = 0;
+    char* line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, input) != -1) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct check_entry* grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) {
+                fprintf(stderr, "Could not allocate memory for %s\n", manifest);
+                free(line);
+                if (input != stdin)
+                    fclose(input);
+                for (size_t i = 0; i < count; i++)
+                    free(entries[i].name);
+                free(entries);
+                return 1;
+            }
+            entries = grown;
+        }
+        if (parse_check_line(line, &entries[count]))
+            count++;
+        else if (line[0] != '\0' && line[0] != '#')
+            malformed++;
+    }
+    free(line);
+    if (input != stdin)
+        fclose(input);
+    if (malformed)
+        fprintf(stderr, "%ld lines are improperly formatted\n", malformed);
+    if (count == 0) {
+        fprintf(stderr, "No properly formatted checksum lines found in %s\n", manifest);
+        free(entries);
+        return 1;
+    }
+
+    struct check_entry** order = malloc(count * sizeof(*order));
+    struct pool* pool = order ? pool_create(workers) : NULL;
+    if (!pool) {
+        fprintf(stderr, "Could not start worker threads.\n");
+        for (size_t i = 0; i < count; i++)
+            free(entries[i].name);
+        free(order);
+        free(entries);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct stat st;
+        entries[i].size = stat(entries[i].name, &st) == 0 ? st.st_size : 0;
+        order[i] = &entries[i];
+    }
+    qsort(order, count, sizeof(*order), larger_first);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < count; i++)
+        pool_submit(pool, check_job, order[i]);
+    pool_destroy(pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long failed = 0;
+    long skipped = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed += entries[i].status == CHECK_FAILED || entries[i].status == CHECK_UNREADABLE;
+        skipped += entries[i].status == CHECK_SKIPPED;
+        free(entries[i].name);
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Checked %zu files, %ld failed, %ld skipped, %.1f MB in %.3f s: %.1f MB/s\n",
+            count, failed, skipped, check.bytes / 1e6, seconds, seconds > 0 ? check.bytes / 1e6 / seconds : 0.0);
+    free(order);
+    free(entries);
+    return failed ? 1 : 0;
+}
+
+/* Next command line without the newline, or NULL at the end of input */
+static char* read_command(int interactive) {
+#ifdef READLINE_AVAILABLE
+    if (interactive) {
+        char* line = readline("> ");
+        if (line && *line)
+            add_history(line);
+        return line;
+    }
 #endif
-        
+    if (interactive)
+        printf("> ");
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read = getline(&line, &len, stdin);
+    if (read == -1) {
+        free(line);
+        return NULL;
+    }
+    if (read > 0 && line[read - 1] == '\n')
+        line[read - 1] = '\0';
+    return line;
+}
+
+int run_repl(void) {
+    int interactive = isatty(STDIN_FILENO);
+    char* line;
+
+    while ((line = read_command(interactive)) != NULL) {
         char* token = strtok(line, " ");
         if (token == NULL) {
-#ifndef READLINE_AVAILABLE
-            printf("> ");
-#endif
+            free(line);
             continue;
         }
-        
+
         char* alg_name = token;
         char* input = strtok(NULL, " ");
-        
+        struct alg_list algs;
+
         if (input == NULL) {
             fprintf(stderr, "Second parameter is missing.\n");
-        } else {
+        } else if (parse_algs(alg_name, &algs)) {
+            /* Checked before the target is opened, so that its errors cannot hide this one */
+            fprintf(stderr, "Unknown command provided.\n");
             if (is_string(input)) {
-                char* str_content = extract_string(input);
-                if (str_content == NULL) {
+                free(line);
+                return 1;
+            }
+        } else if (is_listing(input)) {
+            hash_listing(alg_name, input, stdout);
+        } else {
+            char output[OUTPUT_SIZE];
+            int res = hash_target(alg_name, input, output);
+            if (res == 0) {
+                printf("%s\n", output);
+            } else if (res == CACHE_MISMATCH) {
+                printf("%s\n", output);
+                fprintf(stderr, "Cached digest mismatch for %s\n", input);
+            } else if (res == STDIN_BUSY) {
+                fprintf(stderr, "Standard input already carries the commands.\n");
+            } else if (is_string(input)) {
+                if (res == CORRUPTED_STRING) {
                     fprintf(stderr, "Corrupted string provided as input: %s.\n", input);
-                    free(line);
-                    return 1;
-                }
-                int res = hash_string(alg_name, str_content);
-                if (res == UNKNOWN_COMMAND) {
-                    free(str_content);
-                    free(line);
-                    fprintf(stderr, "Unknown command provided.\n");
-                    return 1;
-                } else if (res == HASH_FAILED) {
-                    free(str_content);
-                    free(line);
+                } else {
                     fprintf(stderr, "Message digest calculation error\n");
-                    return 1;
                 }
-                free(str_content);
+                free(line);
+                return 1;
             } else {
-                hash_file(alg_name, input);
+                fprintf(stderr, "Message digest calculation error for %s\n", input);
             }
         }
-#ifdef READLINE_AVAILABLE
         free(line);
-#else
-        printf("> ");
-#endif
     }
-#ifndef READLINE_AVAILABLE
-    free(line);
-#endif
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * One-shot mode: "rhasher ALG target..." hashes the targets given on the
+ * command line. With --tee the data read from "-" goes on to stdout, so the
+ * results are printed on stderr instead.
+ */
+int run_targets (const char* alg_name, char** targets, int count) {
+    FILE* out = tee_stdin ? stderr : stdout;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        const char* input = targets[i];
+        char output[OUTPUT_SIZE];
+        int res;
+        if (is_listing(input)) {
+            res = hash_listing(alg_name, input, out);
+            if (res == UNKNOWN_COMMAND)
+                fprintf(stderr, "Unknown command provided.\n");
+        } else {
+            res = hash_target(alg_name, input, output);
+            if (res == 0 || res == CACHE_MISMATCH)
+                fprintf(out, "%s  %s\n", output, input);
+            if (res == UNKNOWN_COMMAND)
+                fprintf(stderr, "Unknown command provided.\n");
+            else if (res == CACHE_MISMATCH)
+                fprintf(stderr, "Cached digest mismatch for %s\n", input);
+            else if (res == CORRUPTED_STRING)
+                fprintf(stderr, "Corrupted string provided as input: %s.\n", input);
+            else if (res != 0)
+                fprintf(stderr, "Message digest calculation error for %s\n", input);
+        }
+        failed |= res != 0;
+        if (res == UNKNOWN_COMMAND)
+            break;
+    }
+    return failed;
+}
+
+static const char* usage =
+    "Usage: rhasher [-b|--batch[=FILE]] [-j|--jobs N] [--io=read|direct|mmap]\n"
+    "               [--cache=FILE [--cache-mode=use|bypass|verify]] [--tree-digest]\n"
+    "               [--chunks=SIZE [--check-chunks=LIST]]\n"
+    "       rhasher -c|--check=MANIFEST [-j|--jobs N] [--fail-fast]\n"
+    "       rhasher [options] [--tee] ALG target...\n"
+    "Reads \"ALG target\" commands, where target is a \"string\" or a file name\n"
+    "and ALG is MD5, SHA1, TTH or several of them joined with '+'.\n"
+    "With --batch the commands come from FILE or stdin and are hashed in parallel.\n"
+    "--io selects how files are read: prefetched large blocks (default), the same\n"
+    "with O_DIRECT, or a sequential mmap.\n"
+    "--cache keeps file digests in FILE and reuses them while the file's device,\n"
+    "inode, size and mtime stay the same. bypass hashes every file and refreshes\n"
+    "the cache, verify also reports files whose cached digest is wrong.\n"
+    "A directory target hashes every regular file below it in path order;\n"
+    "--tree-digest adds a Merkle digest of the whole tree as a \"dir/\" line.\n"
+    "--chunks=SIZE hashes each file in SIZE pieces (K, M and G suffixes) in\n"
+    "parallel, printing \"file#N\" lines and a tree digest of the chunks;\n"
+    "--check-chunks=LIST compares them with a LIST printed earlier and only\n"
+    "prints the chunks that changed; the whole file is still read and hashed,\n"
+    "as the list holds no data that would tell an unchanged chunk apart.\n"
+    "--check=MANIFEST verifies a md5sum/sha1sum style file in parallel, largest\n"
+    "files first; --fail-fast stops starting new files after the first failure.\n"
+    "Targets given on the command line are hashed without reading commands;\n"
+    "there \"-\" streams stdin, and --tee copies it to stdout on the way while\n"
+    "the digests go to stderr.\n";
+
+/* "64M" and the like; returns 0 for anything malformed */
+static off_t parse_size (const char* text) {
+    char* end;
+    long long size = strtoll(text, &end, 10);
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10;
+    else if (*end == 'M' || *end == 'm') shift = 20;
+    else if (*end == 'G' || *end == 'g') shift = 30;
+    if (shift)
+        end++;
+    if (*end != '\0' || size <= 0 || size > (LLONG_MAX >> shift))
+        return 0;
+    return (off_t)size << shift;
+}
+
+int main (int argc, char** argv) {
+    static struct option long_options[] = {
+        {"batch", optional_argument, 0, 'b'},
+        {"jobs", required_argument, 0, 'j'},
+        {"io", required_argument, 0, 'i'},
+        {"cache", required_argument, 0, 'C'},
+        {"cache-mode", required_argument, 0, 'm'},
+        {"tree-digest", no_argument, 0, 't'},
+        {"chunks", required_argument, 0, 's'},
+        {"check-chunks", required_argument, 0, 'l'},
+        {"check", required_argument, 0, 'c'},
+        {"fail-fast", no_argument, 0, 'f'},
+        {"tee", no_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int batch_mode = 0;
+    const char* batch_file = NULL;
+    const char* cache_file = NULL;
+    const char* manifest = NULL;
+    int opt;
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt_long(argc, argv, "bj:hc:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                batch_mode = 1;
+                batch_file = optarg;
+                break;
+            case 'j':
+                jobs = atol(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "Incorrect number of jobs: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i': {
+                int method = io_method_parse(optarg);
+                if (method == -1) {
+                    fprintf(stderr, "Unknown I/O method: %s\n", optarg);
+                    return 1;
+                }
+                io_method = method;
+                break;
+            }
+            case 'C':
+                cache_file = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "use") == 0) {
+                    cache_mode = CACHE_USE;
+                } else if (strcmp(optarg, "bypass") == 0) {
+                    cache_mode = CACHE_BYPASS;
+                } else if (strcmp(optarg, "verify") == 0) {
+                    cache_mode = CACHE_VERIFY;
+                } else {
+                    fprintf(stderr, "Unknown cache mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                tree_digest_wanted = 1;
+                break;
+            case 's':
+                chunk_size = parse_size(optarg);
+                if (chunk_size <= 0) {
+                    fprintf(stderr, "Incorrect chunk size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                chunk_list = optarg;
+                break;
+            case 'c':
+                manifest = optarg;
+                break;
+            case 'f':
+                check.fail_fast = 1;
+                break;
+            case 'T':
+                tee_stdin = 1;
+                break;
+            case 'h':
+                printf("%s", usage);
+                return 0;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    int one_shot = optind < argc;
+    if (one_shot && (batch_mode || manifest || optind + 1 == argc)) {
+        fprintf(stderr, "Incorrect usage.\n%s", usage);
+        return 1;
+    }
+    /* stdin is free for a "-" target unless the commands are read from it */
+    if (one_shot || (batch_mode && batch_file && strcmp(batch_file, "-") != 0) ||
+            (manifest && strcmp(manifest, "-") != 0))
+        stdin_commands = 0;
+    if (jobs < 1)
+        jobs = 1;
+
+    if (cache_file) {
+        if (cache_open(cache_file) == -1) {
+            fprintf(stderr, "Could not open cache %s\n", cache_file);
+            return 1;
+        }
+        if (cache_mode == CACHE_OFF)
+            cache_mode = CACHE_USE;
+    } else if (cache_mode != CACHE_OFF) {
+        fprintf(stderr, "--cache-mode needs --cache\n");
+        return 1;
+    }
+    if (chunk_list && !chunk_size) {
+        fprintf(stderr, "--check-chunks needs --chunks\n");
+        return 1;
+    }
+
+    rhash_library_init();
+    int res;
+    if (one_shot) {
+        res = run_targets(argv[optind], argv + optind + 1, argc - optind - 1);
+        cache_close();
+        return res;
+    }
+    if (manifest) {
+        res = run_check(manifest, jobs);
+        cache_close();
+        return res;
+    }
+    if (!batch_mode) {
+        res = run_repl();
+        cache_close();
+        return res;
+    }
+
+    FILE* input = stdin;
+    if (batch_file && strcmp(batch_file, "-") != 0) {
+        input = fopen(batch_file, "r");
+        if (!input) {
+            fprintf(stderr, "Could not open %s\n", batch_file);
+            return 1;
+        }
+    }
+    res = run_batch(input, jobs);
+    if (input != stdin)
+        fclose(input);
+    cache_close();
+    return res;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "pool.h"
+#include "tree.h"
+
+/* Enough for a few hundred entries per getdents64 call */
+#define DENTS_BUFFER_SIZE (64 * 1024)
+
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk {
+    struct pool* pool;
+    const char* root;
+    size_t digest_bytes;
+    tree_hash_fn hash;
+    void* arg;
+    pthread_mutex_t lock;
+    struct tree_entry* entries;
+    size_t count;
+    size_t capacity;
+    int errors;
+};
+
+/* An open directory, kept until the last file job inside it is done */
+struct walk_dir {
+    int fd;
+    char* path;
+    int refs;
+};
+
+/* A name to list or hash inside an open directory, or the root itself */
+struct walk_item {
+    struct walk* walk;
+    struct walk_dir* parent;
+    char* name;
+};
+
+static void dir_put(struct walk_dir* dir) {
+    if (!dir || __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    close(dir->fd);
+    free(dir->path);
+    free(dir);
+}
+
+static char* join_path(const struct walk_dir* parent, const char* name) {
+    if (!parent || parent->path[0] == '\0')
+        return strdup(parent ? name : "");
+    char* path;
+    if (asprintf(&path, "%s/%s", parent->path, name) == -1)
+        return NULL;
+    return path;
+}
+
+static void walk_error(struct walk* walk, const char* path) {
+    size_t len = strlen(walk->root);
+    const char* separator = *path && len && walk->root[len - 1] != '/' ? "/" : "";
+    fprintf(stderr, "Could not read directory %s%s%s\n", walk->root, separator, path);
+    pthread_mutex_lock(&walk->lock);
+    walk->errors++;
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void file_job(void* arg);
+static void dir_job(void* arg);
+
+static void submit(struct walk* walk, struct walk_dir* parent, const char* name, pool_job job) {
+    struct walk_item* item = malloc(sizeof(*item));
+    if (!item || !(item->name = strdup(name))) {
+        free(item);
+        walk_error(walk, parent->path);
+        return;
+    }
+    item->walk = walk;
+    item->parent = parent;
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    pool_submit(walk->pool, job, item);
+}
+
+static void free_item(struct walk_item* item) {
+    dir_put(item->parent);
+    free(item->name);
+    free(item);
+}
+
+static void file_job(void* arg) {
+    struct walk_item* item = arg;
+    struct walk* walk = item->walk;
+    struct tree_entry entry;
+    entry.path = join_path(item->parent, item->name);
+    entry.digests = malloc(walk->digest_bytes);
+    if (entry.path && entry.digests) {
+        entry.status = walk->hash(item->parent->fd, item->name, entry.digests, walk->arg);
+        pthread_mutex_lock(&walk->lock);
+        if (walk->count == walk->capacity) {
+            size_t capacity = walk->capacity ? walk->capacity * 2 : 256;
+            struct tree_entry* entries = realloc(walk->entries, capacity * sizeof(*entries));
+            if (entries) {
+                walk->entries = entries;
+                walk->capacity = capacity;
+            }
+        }
+        int stored = walk->count < walk->capacity;
+        if (stored)
+            walk->entries[walk->count++] = entry;
+        pthread_mutex_unlock(&walk->lock);
+        if (stored) {
+            free_item(item);
+            return;
+        }
+    }
+    free(entry.path);
+    free(entry.digests);
+    walk_error(walk, item->parent->path);
+    free_item(item);
+}
+
+/* One getdents64 buffer per pool thread, freed by the key destructor when the thread exits */
+static __thread char* dents_buffer = NULL;
+static pthread_key_t dents_key;
+static pthread_once_t dents_once = PTHREAD_ONCE_INIT;
+
+static void free_dents_buffer(void* arg) {
+    (void)arg;
+    free(dents_buffer);
+    dents_buffer = NULL;
+}
+
+static void create_dents_key(void) {
+    pthread_key_create(&dents_key, free_dents_buffer);
+}
+
+static char* get_dents_buffer(void) {
+    if (!dents_buffer && (dents_buffer = malloc(DENTS_BUFFER_SIZE))) {
+        pthread_once(&dents_once, create_dents_key);
+        pthread_setspecific(dents_key, dents_buffer);
+    }
+    return dents_buffer;
+}
+
+static void dir_job(void* arg) {
+    struct walk_item* item = arg;
+    struct walk* walk = item->walk;
+    struct walk_dir* dir = calloc(1, sizeof(*dir));
+    if (!dir || !(dir->path = join_path(item->parent, item->name))) {
+        free(dir);
+        walk_error(walk, item->name);
+        free_item(item);
+        return;
+    }
+    dir->refs = 1;
+    dir->fd = openat(item->parent ? item->parent->fd : AT_FDCWD, item->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char* buffer = get_dents_buffer();
+    if (dir->fd == -1 || !buffer) {
+        walk_error(walk, dir->path);
+        if (dir->fd != -1)
+            close(dir->fd);
+        free(dir->path);
+        free(dir);
+        free_item(item);
+        return;
+    }
+
+    long n;
+    while ((n = syscall(SYS_getdents64, dir->fd, buffer, DENTS_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64* dent = (struct linux_dirent64*)(buffer + pos);
+            pos += dent->d_reclen;
+            const char* name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            unsigned char type = dent->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR)
+                submit(walk, dir, name, dir_job);
+            else if (type == DT_REG)
+                submit(walk, dir, name, file_job);
+        }
+    }
+    if (n == -1)
+        walk_error(walk, dir->path);
+    dir_put(dir);
+    free_item(item);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const struct tree_entry*)a)->path, ((const struct tree_entry*)b)->path);
+}
+
+int tree_walk(const char* root, int workers, size_t digest_bytes, tree_hash_fn hash, void* arg, struct tree* tree) {
+    struct walk walk = {
+        .root = root,
+        .digest_bytes = digest_bytes,
+        .hash = hash,
+        .arg = arg,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    memset(tree, 0, sizeof(*tree));
+    struct walk_item* item = calloc(1, sizeof(*item));
+    if (!item || !(item->name = strdup(root))) {
+        free(item);
+        return -1;
+    }
+    item->walk = &walk;
+    walk.pool = pool_create(workers);
+    if (!walk.pool) {
+        free_item(item);
+        return -1;
+    }
+    pool_submit(walk.pool, dir_job, item);
+    pool_destroy(walk.pool);
+
+    qsort(walk.entries, walk.count, sizeof(*walk.entries), compare_entries);
+    tree->entries = walk.entries;
+    tree->count = walk.count;
+    tree->errors = walk.errors;
+    return 0;
+}
+
+void tree_free(struct tree* tree) {
+    for (size_t i = 0; i < tree->count; i++) {
+        free(tree->entries[i].path);
+        free(tree->entries[i].digests);
+    }
+    free(tree->entries);
+    memset(tree, 0, sizeof(*tree));
+}
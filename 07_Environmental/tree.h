@@ -0,0 +1,31 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+
+/*
+ * Parallel directory walk: every directory listing and every regular file
+ * is a job on a work-stealing pool. Symbolic links and special files are
+ * skipped.
+ */
+
+struct tree_entry {
+    char* path;             /* relative to the root, '/' separated */
+    int status;             /* what the hash callback returned */
+    unsigned char* digests; /* digest_bytes filled in by the callback */
+};
+
+struct tree {
+    struct tree_entry* entries; /* sorted by path in strcmp order */
+    size_t count;
+    int errors;                 /* directories that could not be read */
+};
+
+/* Called on a worker thread for each regular file, name being relative to dirfd */
+typedef int (*tree_hash_fn)(int dirfd, const char* name, unsigned char* digests, void* arg);
+
+/* Returns 0, or -1 if the walk could not be started; unreadable directories count as errors */
+int tree_walk(const char* root, int workers, size_t digest_bytes, tree_hash_fn hash, void* arg, struct tree* tree);
+void tree_free(struct tree* tree);
+
+#endif
@@ -5,48 +5,231 @@
 #include <locale.h>
 #include "config.h"
 #include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 #define _(STRING) gettext(STRING)
 
-int main() {
-    int low = 1;
-    int high = 100;
-    int guess;
+/* Largest upper bound of the range the game is played over */
+#define GUESS_MAX (UINT64_C(1) << 63)
+
+/* Whether the secret number is bigger than guess: 1 for yes, 0 for no, -1 to give up */
+typedef int (*guess_oracle)(uint64_t guess, void *arg);
+
+/*
+ * Binary search for a number in [low, high], asking the oracle about the
+ * midpoint. Stores the number found and the number of questions asked;
+ * returns -1 if the oracle gave up.
+ */
+int guess_number(uint64_t low, uint64_t high, guess_oracle oracle, void *arg, uint64_t *number, unsigned *questions) {
+    unsigned asked = 0;
+    while (low < high) {
+        uint64_t guess = low + (high - low) / 2;
+        int answer = oracle(guess, arg);
+        asked++;
+        if (answer < 0) {
+            *questions = asked;
+            return -1;
+        }
+        if (answer)
+            low = guess + 1;
+        else
+            high = guess;
+    }
+    *number = low;
+    *questions = asked;
+    return 0;
+}
+
+/* The questions of the game, translated once at startup */
+static struct {
+    const char *bigger;
+    const char *invalid;
+} prompts;
+
+/* Looks the questions up in the message catalog of the current locale */
+static void load_prompts(void) {
+    prompts.bigger = _("Is your number bigger than %llu? (Yes/No): ");
+    prompts.invalid = _("Invalid answer, it should be either yes or no.\n");
+}
+
+/* The player at the terminal */
+static int ask_user(uint64_t guess, void *arg) {
     char answer[10];
-    setlocale(LC_ALL, "");
-    bindtextdomain(PACKAGE, LOCALEDIR);
-    textdomain(PACKAGE);
-    printf(_("Think of a number between 1 and 100.\n"));
+    (void)arg;
+    while (1) {
+        printf(prompts.bigger, (unsigned long long)guess);
 
-    while (low <= high) {
-        guess = (low + high) / 2;
+        if (fgets(answer, sizeof(answer), stdin) == NULL) {
+            printf(_("Input error.\n"));
+            return -1;
+        }
 
-        if (low == high) {
-            printf(_("Your number: %d\n", guess));
-            break;
+        answer[strcspn(answer, "\n")] = 0;
+
+        if (strcmp(answer, "Yes") == 0) {
+            return 1;
+        } else if (strcmp(answer, "No") == 0) {
+            return 0;
+        } else {
+            fputs(prompts.invalid, stdout);
         }
+    }
+}
 
-        while (1) {
-            printf(_("Is your number bigger than %d? (Yes/No): ", guess));
-            
-            if (fgets(answer, sizeof(answer), stdin) == NULL) {
-                printf(_("Input error.\n"));
-                return 1;
-            }
+/* An oracle that knows the secret, for the harness */
+static int compare_secret(uint64_t guess, void *arg) {
+    return *(const uint64_t *)arg > guess;
+}
+
+/* The part of the range one harness thread plays through */
+struct slice {
+    pthread_t thread;
+    uint64_t low;
+    uint64_t high;
+    uint64_t first;
+    uint64_t last;
+    uint64_t games;
+    uint64_t questions;
+    uint64_t wrong;
+    unsigned max_questions;
+};
+
+static void *play_slice(void *arg) {
+    struct slice *slice = arg;
+    uint64_t secret = slice->first;
+    for (;;) {
+        uint64_t number;
+        unsigned questions;
+        guess_number(slice->low, slice->high, compare_secret, &secret, &number, &questions);
+        slice->games++;
+        slice->questions += questions;
+        if (questions > slice->max_questions)
+            slice->max_questions = questions;
+        if (number != secret)
+            slice->wrong++;
+        if (secret == slice->last)
+            break;
+        secret++;
+    }
+    return NULL;
+}
+
+/*
+ * Play one game for every secret number in [low, high], split between
+ * threads, and check that each one is found.
+ */
+static int play_all(uint64_t low, uint64_t high, int threads) {
+    struct slice *slices = calloc(threads, sizeof(*slices));
+    if (slices == NULL)
+        return 1;
+    /* Cannot overflow as high is at most 2^63 */
+    uint64_t count = high - low + 1;
+    if (count < (uint64_t)threads)
+        threads = count;
+    uint64_t share = count / threads;
+    uint64_t extra = count % threads;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        slices[i].low = low;
+        slices[i].high = high;
+        slices[i].first = i ? slices[i - 1].last + 1 : low;
+        slices[i].last = slices[i].first + share - 1 + ((uint64_t)i < extra);
+        if (pthread_create(&slices[i].thread, NULL, play_slice, &slices[i]) != 0)
+            play_slice(&slices[i]);
+        else
+            started = i + 1;
+    }
+    uint64_t games = 0, questions = 0, wrong = 0;
+    unsigned max_questions = 0;
+    for (int i = 0; i < threads; i++) {
+        if (i < started)
+            pthread_join(slices[i].thread, NULL);
+        games += slices[i].games;
+        questions += slices[i].questions;
+        wrong += slices[i].wrong;
+        if (slices[i].max_questions > max_questions)
+            max_questions = slices[i].max_questions;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(slices);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf(_("Played %llu games in %.3f s: %.2f questions per game (at most %u), %.0f games/s\n"),
+           (unsigned long long)games, seconds, (double)questions / games, max_questions,
+           seconds > 0 ? games / seconds : 0.0);
+    if (wrong) {
+        printf(_("%llu games ended with a wrong number\n"), (unsigned long long)wrong);
+        return 1;
+    }
+    return 0;
+}
 
-            answer[strcspn(answer, "\n")] = 0;
-            
-            if (strcmp(answer, "Yes") == 0) {
-                low = guess + 1;
+static int parse_bound(const char *text, uint64_t *bound) {
+    char *end;
+    if (text[0] == '-')
+        return -1;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end != '\0' || end == text || value > GUESS_MAX)
+        return -1;
+    *bound = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"low", required_argument, 0, 'l'},
+        {"high", required_argument, 0, 'u'},
+        {"play-all", optional_argument, 0, 'a'},
+        {0, 0, 0, 0}
+    };
+    uint64_t low = 1;
+    uint64_t high = 100;
+    uint64_t number;
+    unsigned questions;
+    int threads = 0;
+    int opt;
+    setlocale(LC_ALL, "");
+    bindtextdomain(PACKAGE, LOCALEDIR);
+    textdomain(PACKAGE);
+    load_prompts();
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+            case 'u':
+                if (parse_bound(optarg, opt == 'l' ? &low : &high) != 0) {
+                    fprintf(stderr, _("Bounds must be numbers from 0 to 2^63.\n"));
+                    return 1;
+                }
                 break;
-            } else if (strcmp(answer, "No") == 0) {
-                high = guess;
+            case 'a':
+                threads = optarg ? atoi(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+                if (threads < 1)
+                    threads = 1;
                 break;
-            } else {
-                printf(_("Invalid answer, it should be either yes or no.\n"));
-            }
+            default:
+                fprintf(stderr, _("Usage: %s [--low N] [--high N] [--play-all[=THREADS]]\n"), basename(argv[0]));
+                return 1;
         }
     }
+    if (low > high) {
+        fprintf(stderr, _("The lower bound is above the upper one.\n"));
+        return 1;
+    }
+    if (threads)
+        return play_all(low, high, threads);
+
+    printf(_("Think of a number between %llu and %llu.\n"), (unsigned long long)low, (unsigned long long)high);
+    if (guess_number(low, high, ask_user, NULL, &number, &questions) != 0)
+        return 1;
+    printf(_("Your number: %llu\n"), (unsigned long long)number);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,101 +1,666 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 
 
-#define SIZE 6
-#define GRID_SIZE (SIZE * 2 + 1)
-
-
-void genMaze(
-    char maze[GRID_SIZE][GRID_SIZE], 
-    int visited[SIZE][SIZE], 
-    int x, 
-    int y
-) {
-    int dx[] = {0, 1, 0, -1};
-    int dy[] = {-1, 0, 1, 0};
-    visited[y][x] = 1;
-    int directions[4] = {0, 1, 2, 3};
-    for (int i = 0; i < 4; i++) {
-        int j = rand() % 4;
-        int temp = directions[i];
-        directions[i] = directions[j];
-        directions[j] = temp;
-    }
-
-    for (int i = 0; i < 4; i++) {
-        int dir = directions[i];
-        int nx = x + dx[dir];
-        int ny = y + dy[dir];
-        
-        if ((nx >= 0 && nx < SIZE && ny >= 0 && ny < SIZE) && !visited[ny][nx]) {
-            int wallX = x * 2 + 1 + dx[dir];
-            int wallY = y * 2 + 1 + dy[dir];
-            maze[wallY][wallX] = '.';
-            genMaze(maze, visited, nx, ny);
+#define DEFAULT_SIZE 6
+/* Keeps grid coordinates within int */
+#define MAX_SIZE 1000000000L
+/* Output buffer of the streaming mode, so that rows go out in large writes */
+#define STREAM_BUFFER_SIZE (4 << 20)
+#define MAX_THREADS 1024
+/* Share of the grid that addWalls() fills with walls at least */
+#ifndef WALL_PERCENT
+#define WALL_PERCENT 15
+#endif
+
+/* The walls a cell owns: its east and south sides, 2 bits per cell */
+#define EAST 1
+#define SOUTH 2
+
+typedef struct {
+    long width, height;         /* in cells */
+    long gridWidth, gridHeight; /* in characters, outer walls included */
+    uint8_t* walls;             /* 4 cells per byte */
+    uint64_t* visited;          /* 1 bit per cell */
+    int shared;                 /* tiles are being generated on several threads */
+} Maze;
+
+/* xoshiro256** state, with a pool of bits for small draws */
+typedef struct {
+    uint64_t s[4];
+    uint64_t bits;
+    int bitCount;
+} Random;
+
+/* A rectangle of cells that gets its own spanning tree and random stream */
+typedef struct {
+    Maze* maze;
+    long x0, y0, x1, y1;        /* cells [x0, x1) x [y0, y1) */
+    Random random;
+    long carved;
+    pthread_t thread;
+} Tile;
+
+/* Moves of the depth-first search, 2 bits each, so that backtracking needs no recursion */
+typedef struct {
+    uint64_t* moves;
+    size_t size, capacity;
+} Stack;
+
+static const int dx[] = {0, 1, 0, -1};
+static const int dy[] = {-1, 0, 1, 0};
+static char wall = '#', room = '.';
+
+
+static uint64_t splitMix64(uint64_t* x) {
+    uint64_t z = *x += UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ z >> 30) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ z >> 27) * UINT64_C(0x94d049bb133111eb);
+    return z ^ z >> 31;
+}
+
+void randomSeed(Random* random, uint64_t seed) {
+    for (int i = 0; i < 4; i++)
+        random->s[i] = splitMix64(&seed);
+    random->bits = 0;
+    random->bitCount = 0;
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return x << k | x >> (64 - k);
+}
+
+uint64_t randomNext(Random* random) {
+    uint64_t* s = random->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/* Advances the state by 2^128 draws, so that each tile gets a stream of its own */
+void randomJump(Random* random) {
+    static const uint64_t jump[] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+    };
+    uint64_t s[4] = {0};
+    for (int i = 0; i < 4; i++)
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & UINT64_C(1) << b)
+                for (int k = 0; k < 4; k++)
+                    s[k] ^= random->s[k];
+            randomNext(random);
+        }
+    memcpy(random->s, s, sizeof(s));
+    random->bits = 0;
+    random->bitCount = 0;
+}
+
+/* A number in [0, n) without modulo bias (Lemire's multiply and reject) */
+uint64_t randomBelow(Random* random, uint64_t n) {
+    unsigned __int128 m = (unsigned __int128)randomNext(random) * n;
+    if ((uint64_t)m < n) {
+        uint64_t threshold = -n % n;
+        while ((uint64_t)m < threshold)
+            m = (unsigned __int128)randomNext(random) * n;
+    }
+    return m >> 64;
+}
+
+/* count random bits taken from a 64-bit draw shared by many small choices */
+static inline unsigned randomBits(Random* random, int count) {
+    if (random->bitCount < count) {
+        random->bits = randomNext(random);
+        random->bitCount = 64;
+    }
+    unsigned bits = random->bits & ((1u << count) - 1);
+    random->bits >>= count;
+    random->bitCount -= count;
+    return bits;
+}
+
+/* One of up to four directions, from two bits at a time */
+static inline int randomDirection(Random* random, int count) {
+    if (count == 1)
+        return 0;
+    if (count == 2)
+        return randomBits(random, 1);
+    for (;;) {
+        unsigned r = randomBits(random, 2);
+        if (r < (unsigned)count)
+            return r;
+    }
+}
+
+static int cellWalls(const Maze* maze, size_t cell) {
+    return maze->walls[cell >> 2] >> (cell & 3) * 2 & 3;
+}
+
+/* Bytes and words at the edge of a tile hold cells of its neighbours too, hence the atomics */
+static void setCellWall(Maze* maze, size_t cell, int side, int wall) {
+    uint8_t mask = side << (cell & 3) * 2;
+    if (maze->shared)
+        wall ? __atomic_fetch_or(&maze->walls[cell >> 2], mask, __ATOMIC_RELAXED)
+             : __atomic_fetch_and(&maze->walls[cell >> 2], (uint8_t)~mask, __ATOMIC_RELAXED);
+    else if (wall)
+        maze->walls[cell >> 2] |= mask;
+    else
+        maze->walls[cell >> 2] &= ~mask;
+}
+
+static int isVisited(const Maze* maze, size_t cell) {
+    uint64_t word = maze->shared ? __atomic_load_n(&maze->visited[cell >> 6], __ATOMIC_RELAXED)
+                                 : maze->visited[cell >> 6];
+    return word >> (cell & 63) & 1;
+}
+
+static void setVisited(Maze* maze, size_t cell) {
+    uint64_t bit = UINT64_C(1) << (cell & 63);
+    if (maze->shared)
+        __atomic_fetch_or(&maze->visited[cell >> 6], bit, __ATOMIC_RELAXED);
+    else
+        maze->visited[cell >> 6] |= bit;
+}
+
+/* Finds the cell that owns the wall at a grid position; returns 0 for rooms, pillars and the border */
+static int wallOwner(const Maze* maze, long row, long col, size_t* cell) {
+    if (row <= 0 || col <= 0 || row >= maze->gridHeight - 1 || col >= maze->gridWidth - 1)
+        return 0;
+    if (row % 2 == 1 && col % 2 == 0) {
+        *cell = (size_t)(row / 2) * maze->width + col / 2 - 1;
+        return EAST;
+    }
+    if (row % 2 == 0 && col % 2 == 1) {
+        *cell = (size_t)(row / 2 - 1) * maze->width + col / 2;
+        return SOUTH;
+    }
+    return 0;
+}
+
+int isWall(const Maze* maze, long row, long col) {
+    size_t cell;
+    int side = wallOwner(maze, row, col, &cell);
+    if (side)
+        return (cellWalls(maze, cell) & side) != 0;
+    return row % 2 == 0 || col % 2 == 0;
+}
+
+/* Puts or removes a wall between two rooms; the border and pillars stay as they are */
+void setWall(Maze* maze, long row, long col, int wall) {
+    size_t cell;
+    int side = wallOwner(maze, row, col, &cell);
+    if (side)
+        setCellWall(maze, cell, side, wall);
+}
+
+static int push(Stack* stack, int dir) {
+    if (stack->size == stack->capacity) {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 4096;
+        uint64_t* moves = realloc(stack->moves, capacity / 32 * sizeof(uint64_t));
+        if (!moves)
+            return -1;
+        stack->moves = moves;
+        stack->capacity = capacity;
+    }
+    uint64_t* word = &stack->moves[stack->size / 32];
+    int shift = stack->size % 32 * 2;
+    *word = (*word & ~(UINT64_C(3) << shift)) | (uint64_t)dir << shift;
+    stack->size++;
+    return 0;
+}
+
+static int pop(Stack* stack) {
+    stack->size--;
+    return stack->moves[stack->size / 32] >> stack->size % 32 * 2 & 3;
+}
+
+/* Carves a passage from a cell to its neighbour in direction dir */
+static void carve(Maze* maze, long x, long y, int dir) {
+    if (dir == 0)
+        setCellWall(maze, (size_t)(y - 1) * maze->width + x, SOUTH, 0);
+    else if (dir == 1)
+        setCellWall(maze, (size_t)y * maze->width + x, EAST, 0);
+    else if (dir == 2)
+        setCellWall(maze, (size_t)y * maze->width + x, SOUTH, 0);
+    else
+        setCellWall(maze, (size_t)y * maze->width + x - 1, EAST, 0);
+}
+
+/* Randomized depth-first search over a tile from its corner; returns the number of passages carved, or -1 if out of memory */
+long genMaze(Maze* maze, Tile* tile) {
+    Stack stack = {0};
+    long carved = 0;
+    long x = tile->x0, y = tile->y0;
+    setVisited(maze, (size_t)y * maze->width + x);
+    for (;;) {
+        int directions[4];
+        int count = 0;
+        for (int dir = 0; dir < 4; dir++) {
+            long nx = x + dx[dir];
+            long ny = y + dy[dir];
+            if (nx >= tile->x0 && nx < tile->x1 && ny >= tile->y0 && ny < tile->y1
+                && !isVisited(maze, (size_t)ny * maze->width + nx))
+                directions[count++] = dir;
+        }
+
+        if (count == 0) {
+            if (stack.size == 0)
+                break;
+            int dir = pop(&stack);
+            x -= dx[dir];
+            y -= dy[dir];
+            continue;
         }
+
+        int dir = directions[randomDirection(&tile->random, count)];
+        if (push(&stack, dir) != 0) {
+            free(stack.moves);
+            return -1;
+        }
+        carve(maze, x, y, dir);
+        x += dx[dir];
+        y += dy[dir];
+        setVisited(maze, (size_t)y * maze->width + x);
+        carved++;
     }
+    free(stack.moves);
+    return carved;
 }
 
-void addWalls(char maze[GRID_SIZE][GRID_SIZE], int currentWalls) {
-    int totalCells = GRID_SIZE * GRID_SIZE;
-    while (currentWalls < totalCells * 15 / 100) {
-        int i = rand() % (GRID_SIZE - 2) + 1;
-        int j = rand() % (GRID_SIZE - 2) + 1;
-        if (maze[i][j] == '.' && (i % 2 == 0 || j % 2 == 0)) {
-            int isCritical = 0;
-            maze[i][j] = '#';
-            int wallCount = 0;
-            for (int di = -1; di <= 1; di++) {
-                for (int dj = -1; dj <= 1; dj++) {
-                    if ((di == 0 || dj == 0) && !(di == 0 && dj == 0)) {
-                        int ni = i + di, nj = j + dj;
-                        if (ni >= 0 && ni < GRID_SIZE && nj >= 0 && nj < GRID_SIZE) {
-                            if (maze[ni][nj] == '#') wallCount++;
-                        }
+static void* genTile(void* arg) {
+    Tile* tile = arg;
+    tile->carved = genMaze(tile->maze, tile);
+    return NULL;
+}
+
+static long findSet(long* parent, long set);
+
+/*
+ * Splits the maze into one tile per thread and generates their spanning
+ * trees in parallel. The tile boundaries are then visited in random order
+ * and one passage is carved across each boundary whose tiles are not yet
+ * connected, as found by union-find, so the result is a perfect maze.
+ * Tile i draws from the stream of random jumped i + 1 times, and the joins
+ * from random itself, so the output depends only on the seed and the
+ * number of threads.
+ * Returns the number of passages carved, or -1 if out of memory.
+ */
+long genTiled(Maze* maze, int threads, Random* random) {
+    int tilesX = threads, tilesY = 1;
+    for (int d = 1; d * d <= threads; d++)
+        if (threads % d == 0) {
+            tilesY = d;
+            tilesX = threads / d;
+        }
+    if (maze->height > maze->width) {
+        int t = tilesX;
+        tilesX = tilesY;
+        tilesY = t;
+    }
+    if (tilesX > maze->width)
+        tilesX = maze->width;
+    if (tilesY > maze->height)
+        tilesY = maze->height;
+
+    long count = (long)tilesX * tilesY;
+    Tile* tiles = calloc(count, sizeof(Tile));
+    long* parent = malloc(count * sizeof(long));
+    long* order = malloc(2 * count * sizeof(long));
+    if (!tiles || !parent || !order) {
+        free(tiles);
+        free(parent);
+        free(order);
+        return -1;
+    }
+    for (long i = 0; i < count; i++) {
+        Tile* tile = &tiles[i];
+        long tx = i % tilesX, ty = i / tilesX;
+        tile->maze = maze;
+        tile->x0 = maze->width * tx / tilesX;
+        tile->x1 = maze->width * (tx + 1) / tilesX;
+        tile->y0 = maze->height * ty / tilesY;
+        tile->y1 = maze->height * (ty + 1) / tilesY;
+        tile->random = i ? tiles[i - 1].random : *random;
+        randomJump(&tile->random);
+        parent[i] = i;
+    }
+
+    maze->shared = count > 1;
+    long started = 0;
+    for (long i = 1; i < count; i++) {
+        if (pthread_create(&tiles[i].thread, NULL, genTile, &tiles[i]) != 0)
+            break;
+        started = i;
+    }
+    for (long i = started + 1; i < count; i++)
+        genTile(&tiles[i]);
+    genTile(&tiles[0]);
+    for (long i = 1; i <= started; i++)
+        pthread_join(tiles[i].thread, NULL);
+    maze->shared = 0;
+
+    long carved = 0;
+    for (long i = 0; i < count; i++) {
+        if (tiles[i].carved < 0)
+            carved = -1;
+        else if (carved >= 0)
+            carved += tiles[i].carved;
+    }
+
+    /* Boundary 2i is the east side of tile i, 2i + 1 its south side */
+    long boundaries = 0;
+    for (long i = 0; i < count; i++) {
+        if (i % tilesX + 1 < tilesX)
+            order[boundaries++] = 2 * i;
+        if (i / tilesX + 1 < tilesY)
+            order[boundaries++] = 2 * i + 1;
+    }
+    for (long i = boundaries - 1; i > 0; i--) {
+        long j = randomBelow(random, i + 1);
+        long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (long i = 0; i < boundaries && carved >= 0; i++) {
+        long a = order[i] / 2;
+        long b = order[i] % 2 ? a + tilesX : a + 1;
+        long setA = findSet(parent, a), setB = findSet(parent, b);
+        if (setA == setB)
+            continue;
+        parent[setB] = setA;
+        Tile* tile = &tiles[a];
+        if (order[i] % 2)
+            carve(maze, tile->x0 + randomBelow(random, tile->x1 - tile->x0), tile->y1 - 1, 2);
+        else
+            carve(maze, tile->x1 - 1, tile->y0 + randomBelow(random, tile->y1 - tile->y0), 1);
+        carved++;
+    }
+    free(tiles);
+    free(parent);
+    free(order);
+    return carved;
+}
+
+/*
+ * Closes random open passages until walls make up WALL_PERCENT of the grid.
+ * Every open passage starts as a candidate, encoded as cell * 2 + (1 for
+ * its south side). A drawn candidate is swap-removed whether it is kept or
+ * not: walls are only ever added, so a position rejected once stays
+ * rejected. Stops when the candidates run out. Returns 0, or -1 if out of
+ * memory.
+ */
+int addWalls(Maze* maze, long long currentWalls, Random* random) {
+    long long totalCells = (long long)maze->gridWidth * maze->gridHeight;
+    size_t cells = (size_t)maze->width * maze->height;
+    size_t count = 0;
+    for (size_t cell = 0; cell < cells; cell++)
+        count += 2 - __builtin_popcount(cellWalls(maze, cell));
+    size_t* candidates = malloc(count * sizeof(size_t));
+    if (!candidates && count)
+        return -1;
+    count = 0;
+    for (size_t cell = 0; cell < cells; cell++) {
+        int walls = cellWalls(maze, cell);
+        if (!(walls & EAST))
+            candidates[count++] = cell * 2;
+        if (!(walls & SOUTH))
+            candidates[count++] = cell * 2 + 1;
+    }
+
+    while (currentWalls < totalCells * WALL_PERCENT / 100 && count > 0) {
+        size_t k = randomBelow(random, count);
+        size_t candidate = candidates[k];
+        candidates[k] = candidates[--count];
+        long x = candidate / 2 % maze->width, y = candidate / 2 / maze->width;
+        long i = candidate % 2 ? 2 * y + 2 : 2 * y + 1;
+        long j = candidate % 2 ? 2 * x + 1 : 2 * x + 2;
+        setWall(maze, i, j, 1);
+        int wallCount = 0;
+        for (int di = -1; di <= 1; di++) {
+            for (int dj = -1; dj <= 1; dj++) {
+                if ((di == 0 || dj == 0) && !(di == 0 && dj == 0)) {
+                    long ni = i + di, nj = j + dj;
+                    if (ni >= 0 && ni < maze->gridHeight && nj >= 0 && nj < maze->gridWidth) {
+                        if (isWall(maze, ni, nj)) wallCount++;
                     }
                 }
             }
-            if (wallCount < 3) {
-                currentWalls++;
+        }
+        if (wallCount < 3) {
+            currentWalls++;
+        } else {
+            setWall(maze, i, j, 0);
+        }
+    }
+    free(candidates);
+    return 0;
+}
+
+void printMaze(const Maze* maze) {
+    char* line = malloc(maze->gridWidth + 1);
+    if (!line)
+        return;
+    line[maze->gridWidth] = '\n';
+    for (long i = 0; i < maze->gridHeight; i++) {
+        for (long j = 0; j < maze->gridWidth; j++)
+            line[j] = isWall(maze, i, j) ? wall : room;
+        fwrite(line, 1, maze->gridWidth + 1, stdout);
+    }
+    free(line);
+}
+
+static long findSet(long* parent, long set) {
+    while (parent[set] != set) {
+        parent[set] = parent[parent[set]];
+        set = parent[set];
+    }
+    return set;
+}
+
+/*
+ * Eller's algorithm: generates the maze one row of cells at a time and
+ * prints each row as soon as it is done, so memory does not depend on height.
+ * Cells of a row carry the label of the set they are connected to above;
+ * adjacent sets are joined at random, every set continues down at least
+ * once, and the last row joins whatever sets are left.
+ */
+int streamMaze(long width, long height, Random* random) {
+    long gridWidth = width * 2 + 1;
+    long* sets = malloc(width * sizeof(long));
+    long* parent = malloc(width * sizeof(long));
+    long* count = calloc(width, sizeof(long));
+    char* down = calloc(width, 1);
+    char* cellLine = malloc(gridWidth + 1);
+    char* floorLine = malloc(gridWidth + 1);
+    static char buffer[STREAM_BUFFER_SIZE];
+    int status = -1;
+    if (!sets || !parent || !count || !down || !cellLine || !floorLine)
+        goto out;
+    setvbuf(stdout, buffer, _IOFBF, STREAM_BUFFER_SIZE);
+
+    for (long x = 0; x < width; x++) {
+        sets[x] = x;
+        parent[x] = x;
+    }
+    memset(floorLine, wall, gridWidth);
+    floorLine[gridWidth] = '\n';
+    fwrite(floorLine, 1, gridWidth + 1, stdout);
+    cellLine[0] = wall;
+    cellLine[gridWidth] = '\n';
+
+    for (long y = 0; y < height; y++) {
+        int last = y == height - 1;
+        for (long x = 0; x < width; x++) {
+            cellLine[2 * x + 1] = room;
+            cellLine[2 * x + 2] = wall;
+        }
+        for (long x = 0; x + 1 < width; x++) {
+            long a = findSet(parent, sets[x]);
+            long b = findSet(parent, sets[x + 1]);
+            if (a != b && (last || randomBits(random, 1))) {
+                parent[b] = a;
+                cellLine[2 * x + 2] = room;
+            }
+        }
+        for (long x = 0; x < width; x++) {
+            sets[x] = findSet(parent, sets[x]);
+            count[sets[x]]++;
+        }
+        for (long x = 0; x < width; x++)
+            parent[x] = x;
+        fwrite(cellLine, 1, gridWidth + 1, stdout);
+
+        memset(floorLine, wall, gridWidth);
+        if (last) {
+            fwrite(floorLine, 1, gridWidth + 1, stdout);
+            break;
+        }
+        /* The last cell of a set that has not gone down yet has to */
+        for (long x = 0; x < width; x++) {
+            long set = sets[x];
+            count[set]--;
+            if (randomBits(random, 1) || (count[set] == 0 && !down[set])) {
+                floorLine[2 * x + 1] = room;
+                down[set] = 1;
             } else {
-                maze[i][j] = '.';
+                sets[x] = -1;
             }
         }
+        fwrite(floorLine, 1, gridWidth + 1, stdout);
+
+        /* Cells that did not go down get labels no set below uses */
+        long next = 0;
+        for (long x = 0; x < width; x++) {
+            if (sets[x] != -1)
+                continue;
+            while (down[next])
+                next++;
+            sets[x] = next++;
+        }
+        memset(down, 0, width);
     }
+    status = fflush(stdout) == 0 ? 0 : -1;
+
+out:
+    free(sets);
+    free(parent);
+    free(count);
+    free(down);
+    free(cellLine);
+    free(floorLine);
+    return status;
 }
 
-int main() {
-    srand(time(NULL));
-    char maze[GRID_SIZE][GRID_SIZE];
-    int visited[SIZE][SIZE] = {0};
-    
-    for (int i = 0; i < GRID_SIZE; i++) 
-        for (int j = 0; j < GRID_SIZE; j++)
-            if (i % 2 == 0 || j % 2 == 0)
-                maze[i][j] = '#';
-            else
-                maze[i][j] = '.';
-    
-    genMaze(maze, visited, 0, 0);
-    int totalCells = GRID_SIZE * GRID_SIZE;
-    int currentWalls = 0;
-    for (int i = 0; i < GRID_SIZE; i++) {
-        for (int j = 0; j < GRID_SIZE; j++) {
-            if (maze[i][j] == '#') {
-                currentWalls++;
+static long parseSize(const char* arg) {
+    char* end;
+    long size = strtol(arg, &end, 10);
+    if (*end != '\0' || size < 1 || size > MAX_SIZE)
+        return -1;
+    return size;
+}
+
+int main(int argc, char** argv) {
+    static struct option longOptions[] = {
+        {"stream", no_argument, 0, 's'},
+        {"threads", required_argument, 0, 'j'},
+        {"seed", required_argument, 0, 'S'},
+        {0, 0, 0, 0}
+    };
+    const char* usage = "Usage: %s [--seed N] [--stream | --threads N] [WIDTH [HEIGHT]]\n"
+        "WIDTH and HEIGHT count cells. Generation takes about 3 bits per cell:\n"
+        "10000x10000 cells (a 20001x20001 grid) need about 40 MB, 20000x20000 about 160 MB.\n"
+        "--stream keeps only one row in memory.\n";
+    int stream = 0;
+    int threads = 1;
+    uint64_t seed = time(NULL);
+    int opt;
+    char* end;
+    Random random;
+    Maze maze = {0};
+    while ((opt = getopt_long(argc, argv, "sj:S:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'S':
+                /* strtoull would quietly wrap a sign or skip leading blanks */
+                seed = strtoull(optarg, &end, 0);
+                if (*end != '\0' || *optarg < '0' || *optarg > '9') {
+                    fprintf(stderr, "Seed must be a number\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                stream = 1;
+                break;
+            case 'j': {
+                long count = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || count < 1 || count > MAX_THREADS) {
+                    fprintf(stderr, "Threads must be a number from 1 to %d\n", MAX_THREADS);
+                    return 1;
+                }
+                threads = count;
+                break;
             }
+            default:
+                fprintf(stderr, usage, argv[0]);
+                return 1;
         }
     }
-    if (currentWalls < totalCells * 15 / 100)
-        addWalls(maze, currentWalls);
-
-    for (int i = 0; i < GRID_SIZE; i++) {
-        for (int j = 0; j < GRID_SIZE; j++) {
-            printf("%c", maze[i][j]);
+    if (argc - optind > 2 || (stream && threads > 1)) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    maze.width = maze.height = argc - optind > 0 ? parseSize(argv[optind]) : DEFAULT_SIZE;
+    if (argc - optind > 1)
+        maze.height = parseSize(argv[optind + 1]);
+    if (maze.width < 1 || maze.height < 1) {
+        fprintf(stderr, "Size must be a number from 1 to %ld\n", MAX_SIZE);
+        return 1;
+    }
+    randomSeed(&random, seed);
+    if (stream) {
+        if (streamMaze(maze.width, maze.height, &random) != 0) {
+            fprintf(stderr, "Could not write the maze\n");
+            return 1;
         }
-        printf("\n");
+        return 0;
     }
+    maze.gridWidth = maze.width * 2 + 1;
+    maze.gridHeight = maze.height * 2 + 1;
+
+    size_t cells = (size_t)maze.width * maze.height;
+    maze.walls = malloc((cells + 3) / 4);
+    maze.visited = calloc((cells + 63) / 64, sizeof(uint64_t));
+    if (!maze.walls || !maze.visited) {
+        fprintf(stderr, "Not enough memory for the maze\n");
+        return 1;
+    }
+    memset(maze.walls, 0xff, (cells + 3) / 4);
+
+    long carved = genTiled(&maze, threads, &random);
+    if (carved < 0) {
+        fprintf(stderr, "Not enough memory for the maze\n");
+        return 1;
+    }
+    free(maze.visited);
+    maze.visited = NULL;
+    /* Everything but the rooms and the passages between them is wall */
+    long long totalCells = (long long)maze.gridWidth * maze.gridHeight;
+    long long currentWalls = totalCells - (long long)cells - carved;
+    if (currentWalls < totalCells * WALL_PERCENT / 100 && addWalls(&maze, currentWalls, &random) != 0) {
+        fprintf(stderr, "Not enough memory for the maze\n");
+        return 1;
+    }
+
+    printMaze(&maze);
+    free(maze.walls);
     return 0;
-}
\ No newline at end of file
+}
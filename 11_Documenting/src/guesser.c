@@ -9,6 +9,7 @@
 * Implementation
 *
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <libgen.h>
@@ -17,12 +18,133 @@
 #include "config.h"
 #include <string.h>
 #include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #define _(STRING) gettext(STRING)
 
-/** Table that contains all roman numerals from 1 to 100.
+/** Size of a buffer that holds any roman numeral from I to MMMCMXCIX.
 */
-static const char *ROMAN_NUMERALS[100] = {
+#define ROMAN_BUFSIZE 16
+
+/** Largest number that has a roman numeral.
+*/
+#define ROMAN_MAX 3999
+
+/** Write the roman digit @p digit of one decimal place into @p out.
+*
+* @param digit a decimal digit from 0 to 9
+* @param one symbol for one unit of the place
+* @param five symbol for five units of the place
+* @param ten symbol for ten units of the place
+* @return pointer just past the written symbols
+*/
+static char *put_roman_digit(int digit, char one, char five, char ten, char *out) {
+    switch (digit) {
+        case 9:
+            *out++ = one;
+            *out++ = ten;
+            return out;
+        case 4:
+            *out++ = one;
+            *out++ = five;
+            return out;
+        default:
+            if (digit >= 5) {
+                *out++ = five;
+                digit -= 5;
+            }
+            while (digit-- > 0)
+                *out++ = one;
+            return out;
+    }
+}
+
+/** Get roman numeral corresponding to its arabic representation @p num.
+*
+* @param num an arabic number from 1 to 3999
+* @param buf caller buffer of at least #ROMAN_BUFSIZE bytes
+* @return @p buf holding the numeral, or NULL if @p num is out of range
+*/
+char *arabic_to_roman(int num, char *buf) {
+    if (num < 1 || num > ROMAN_MAX) {
+        return NULL;
+    }
+    char *out = buf;
+    out = put_roman_digit(num / 1000, 'M', '?', '?', out);
+    out = put_roman_digit(num / 100 % 10, 'C', 'D', 'M', out);
+    out = put_roman_digit(num / 10 % 10, 'X', 'L', 'C', out);
+    out = put_roman_digit(num % 10, 'I', 'V', 'X', out);
+    *out = '\0';
+    return buf;
+}
+
+/** Upper-case a latin letter without consulting the locale.
+*/
+static inline char roman_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+/** Read the roman digit of one decimal place at @p *pos and advance past it.
+*
+* Accepts exactly the canonical forms: up to three @p one symbols, optionally
+* preceded by @p five, or the subtractive pairs for 4 and 9.
+*
+* @return the decimal digit, 0 if the place is absent
+*/
+static int get_roman_digit(const char **pos, char one, char five, char ten) {
+    const char *p = *pos;
+    int digit = 0;
+    if (roman_upper(p[0]) == one && ten && roman_upper(p[1]) == ten) {
+        *pos = p + 2;
+        return 9;
+    }
+    if (roman_upper(p[0]) == one && five && roman_upper(p[1]) == five) {
+        *pos = p + 2;
+        return 4;
+    }
+    if (five && roman_upper(p[0]) == five) {
+        digit = 5;
+        p++;
+    }
+    for (int i = 0; i < 3 && roman_upper(*p) == one; i++) {
+        digit++;
+        p++;
+    }
+    *pos = p;
+    return digit;
+}
+
+/** Get arabic number corresponding to its roman representation @p roman.
+*
+* The numeral is parsed in a single pass, in either case, and must be in
+* canonical form: "IIII", "IC" or "VX" are rejected.
+*
+* @param roman a roman numeral from I to MMMCMXCIX
+* @return corresponding arabic number for @p roman, or -1 if it is not valid
+*/
+int roman_to_arabic(const char *roman) {
+    if (roman == NULL) {
+        return -1;
+    }
+    const char *p = roman;
+    int num = get_roman_digit(&p, 'M', 0, 0) * 1000;
+    num += get_roman_digit(&p, 'C', 'D', 'M') * 100;
+    num += get_roman_digit(&p, 'X', 'L', 'C') * 10;
+    num += get_roman_digit(&p, 'I', 'V', 'X');
+    if (*p != '\0' || num == 0) {
+        return -1;
+    }
+    return num;
+}
+
+/** Table of the roman numerals from 1 to 100 that the codec replaced.
+*
+* Kept only so that the benchmark can compare against the old lookup.
+*/
+static const char *LEGACY_ROMAN_NUMERALS[100] = {
     "I", "II", "III", "IV", "V", "VI", "VII", "VIII", "IX", "X",
     "XI", "XII", "XIII", "XIV", "XV", "XVI", "XVII", "XVIII", "XIX", "XX",
     "XXI", "XXII", "XXIII", "XXIV", "XXV", "XXVI", "XXVII", "XXVIII", "XXIX", "XXX",
@@ -35,44 +157,336 @@ static const char *ROMAN_NUMERALS[100] = {
     "XCI", "XCII", "XCIII", "XCIV", "XCV", "XCVI", "XCVII", "XCVIII", "XCIX", "C"
 };
 
-/** Get roman number corresponding to its arabic representation @p num.
-*
-* @param num an arabic number from 1 to 100
-* @return corresponding roman numeral for @p num
-*/
-const char *arabic_to_roman(int num) {
-    return ROMAN_NUMERALS[num - 1];
-}
-
-/** Get arabic number corresponding to its roman representation @p roman.
-*
-* @param roman a roman numeral from I to C
-* @return corresponding arabic number for @p roman
+/** The former roman_to_arabic(): upper-case, then compare with every table entry.
 */
-int roman_to_arabic(const char *roman) {
+static int legacy_roman_to_arabic(const char *roman) {
     char upper_roman[100];
     int i;
     if (roman == NULL || strlen(roman) == 0) {
         return -1;
     }
     for (i = 0; roman[i] && i < 100 - 1; i++) {
-        upper_roman[i] = (roman[i] >= 'a' && roman[i] <= 'z') ? 
-                         roman[i] - 'a' + 'A' : roman[i];
+        upper_roman[i] = roman_upper(roman[i]);
     }
     upper_roman[i] = '\0';
     for (i = 0; i < 100; i++) {
-        if (strcmp(upper_roman, ROMAN_NUMERALS[i]) == 0) {
+        if (strcmp(upper_roman, LEGACY_ROMAN_NUMERALS[i]) == 0) {
             return i + 1;
         }
     }
     return -1;
 }
 
+/** Seconds on a monotonic clock.
+*/
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Compare the codec with the old table lookup over 1..100, @p rounds times.
+*/
+static void run_benchmark(long rounds) {
+    char numerals[100][ROMAN_BUFSIZE];
+    char buf[ROMAN_BUFSIZE];
+    volatile long sink = 0;
+    for (int i = 0; i < 100; i++) {
+        arabic_to_roman(i + 1, numerals[i]);
+    }
+
+    double start = now();
+    for (long r = 0; r < rounds; r++)
+        for (int i = 0; i < 100; i++)
+            sink += legacy_roman_to_arabic(numerals[i]);
+    double legacy_parse = now() - start;
+
+    start = now();
+    for (long r = 0; r < rounds; r++)
+        for (int i = 0; i < 100; i++)
+            sink += roman_to_arabic(numerals[i]);
+    double parse = now() - start;
+
+    start = now();
+    for (long r = 0; r < rounds; r++)
+        for (int i = 0; i < 100; i++)
+            sink += LEGACY_ROMAN_NUMERALS[i][0];
+    double legacy_encode = now() - start;
+
+    start = now();
+    for (long r = 0; r < rounds; r++)
+        for (int i = 1; i <= 100; i++)
+            sink += arabic_to_roman(i, buf)[0];
+    double encode = now() - start;
+
+    double count = rounds * 100.0;
+    printf("roman to arabic: table %.1f M/s, codec %.1f M/s\n", count / legacy_parse / 1e6, count / parse / 1e6);
+    printf("arabic to roman: table %.1f M/s, codec %.1f M/s\n", count / legacy_encode / 1e6, count / encode / 1e6);
+    (void)sink;
+}
+
+/** Convert numbers from stdin to stdout, one per line, in either direction.
+*
+* A line starting with a digit is taken as arabic and written as a roman
+* numeral, anything else is parsed as a roman numeral. Invalid lines give an
+* empty output line, so that records stay aligned, and a message on stderr.
+*
+* @return 0, or 1 if some line could not be converted
+*/
+static int run_convert(void) {
+    static char in_buffer[1 << 20];
+    static char out_buffer[1 << 20];
+    setvbuf(stdin, in_buffer, _IOFBF, sizeof(in_buffer));
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    long line_no = 0;
+    int failed = 0;
+    while ((len = getline(&line, &size, stdin)) != -1) {
+        line_no++;
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            line[--len] = '\0';
+        char buf[ROMAN_BUFSIZE];
+        const char *result = NULL;
+        if (line[0] >= '0' && line[0] <= '9') {
+            char *end;
+            long num = strtol(line, &end, 10);
+            if (*end == '\0' && num >= 1 && num <= ROMAN_MAX)
+                result = arabic_to_roman(num, buf);
+        } else {
+            int num = roman_to_arabic(line);
+            if (num > 0) {
+                snprintf(buf, sizeof(buf), "%d", num);
+                result = buf;
+            }
+        }
+        if (result) {
+            fputs_unlocked(result, stdout);
+        } else {
+            fprintf(stderr, _("Line %ld: cannot convert \"%s\"\n"), line_no, line);
+            failed = 1;
+        }
+        putchar_unlocked('\n');
+    }
+    free(line);
+    fflush(stdout);
+    return failed;
+}
+
+/** Largest upper bound of the range the game is played over, 2^63.
+*/
+#define GUESS_MAX (UINT64_C(1) << 63)
+
+/** Answer whether the secret number is bigger than @p guess.
+*
+* @param guess the number asked about
+* @param arg whatever was passed to guess_number()
+* @return 1 for yes, 0 for no, -1 to give up the game
+*/
+typedef int (*guess_oracle)(uint64_t guess, void *arg);
+
+/** Find a number in [@p low, @p high] by binary search, asking @p oracle about the midpoint.
+*
+* This is the game itself, without any input or output, so that it can be
+* played by the user at the terminal as well as by the test harness.
+*
+* @param number receives the number found
+* @param questions receives the number of questions asked
+* @return 0, or -1 if the oracle gave up
+*/
+int guess_number(uint64_t low, uint64_t high, guess_oracle oracle, void *arg, uint64_t *number, unsigned *questions) {
+    unsigned asked = 0;
+    while (low < high) {
+        uint64_t guess = low + (high - low) / 2;
+        int answer = oracle(guess, arg);
+        asked++;
+        if (answer < 0) {
+            *questions = asked;
+            return -1;
+        }
+        if (answer)
+            low = guess + 1;
+        else
+            high = guess;
+    }
+    *number = low;
+    *questions = asked;
+    return 0;
+}
+
+/** Write @p num in arabic or, if @p use_roman is set, roman numerals into @p buf.
+*/
+static const char *format_number(uint64_t num, int use_roman, char *buf, size_t size) {
+    if (use_roman)
+        return arabic_to_roman(num, buf);
+    snprintf(buf, size, "%llu", (unsigned long long)num);
+    return buf;
+}
+
+/** Questions of the game, translated once at startup by load_prompts().
+*/
+static struct {
+    const char *bigger;
+    const char *invalid;
+} prompts;
+
+/** Look the questions up in the message catalog of the current locale.
+*/
+static void load_prompts(void) {
+    prompts.bigger = _("Is your number bigger than %s? (Yes/No): ");
+    prompts.invalid = _("Invalid answer, it should be either yes or no.\n");
+}
+
+/** Oracle asking the user at the terminal; @p arg points to the use_roman flag.
+*/
+static int ask_user(uint64_t guess, void *arg) {
+    char number[32];
+    char answer[10];
+    format_number(guess, *(const int *)arg, number, sizeof(number));
+    while (1) {
+        printf(prompts.bigger, number);
+
+        if (fgets(answer, sizeof(answer), stdin) == NULL) {
+            printf(_("Input error.\n"));
+            return -1;
+        }
+
+        answer[strcspn(answer, "\n")] = 0;
+
+        if (strcmp(answer, "Yes") == 0) {
+            return 1;
+        } else if (strcmp(answer, "No") == 0) {
+            return 0;
+        } else {
+            fputs(prompts.invalid, stdout);
+        }
+    }
+}
+
+/** Oracle that knows the secret, @p arg pointing to it.
+*/
+static int compare_secret(uint64_t guess, void *arg) {
+    return *(const uint64_t *)arg > guess;
+}
+
+/** The part of the range one harness thread plays through, and its results.
+*/
+struct slice {
+    pthread_t thread;
+    uint64_t low;           /**< range of the game */
+    uint64_t high;
+    uint64_t first;         /**< secrets played by this thread */
+    uint64_t last;
+    uint64_t games;
+    uint64_t questions;     /**< in all games together */
+    uint64_t wrong;         /**< games that found another number */
+    unsigned max_questions;
+};
+
+/** Thread body: play a game for every secret of a #slice.
+*/
+static void *play_slice(void *arg) {
+    struct slice *slice = arg;
+    uint64_t secret = slice->first;
+    for (;;) {
+        uint64_t number;
+        unsigned questions;
+        guess_number(slice->low, slice->high, compare_secret, &secret, &number, &questions);
+        slice->games++;
+        slice->questions += questions;
+        if (questions > slice->max_questions)
+            slice->max_questions = questions;
+        if (number != secret)
+            slice->wrong++;
+        if (secret == slice->last)
+            break;
+        secret++;
+    }
+    return NULL;
+}
+
+/** Play one game for every secret number in [@p low, @p high] on @p threads threads.
+*
+* Checks that every game finds its secret and reports the questions per game
+* and the games per second.
+*
+* @return 0, or 1 if some game went wrong
+*/
+static int play_all(uint64_t low, uint64_t high, int threads) {
+    struct slice *slices = calloc(threads, sizeof(*slices));
+    if (slices == NULL)
+        return 1;
+    /* Cannot overflow as high is at most 2^63 */
+    uint64_t count = high - low + 1;
+    if (count < (uint64_t)threads)
+        threads = count;
+    uint64_t share = count / threads;
+    uint64_t extra = count % threads;
+
+    double start = now();
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        slices[i].low = low;
+        slices[i].high = high;
+        slices[i].first = i ? slices[i - 1].last + 1 : low;
+        slices[i].last = slices[i].first + share - 1 + ((uint64_t)i < extra);
+        if (pthread_create(&slices[i].thread, NULL, play_slice, &slices[i]) != 0)
+            play_slice(&slices[i]);
+        else
+            started = i + 1;
+    }
+    uint64_t games = 0, questions = 0, wrong = 0;
+    unsigned max_questions = 0;
+    for (int i = 0; i < threads; i++) {
+        if (i < started)
+            pthread_join(slices[i].thread, NULL);
+        games += slices[i].games;
+        questions += slices[i].questions;
+        wrong += slices[i].wrong;
+        if (slices[i].max_questions > max_questions)
+            max_questions = slices[i].max_questions;
+    }
+    double seconds = now() - start;
+    free(slices);
+
+    printf(_("Played %llu games in %.3f s: %.2f questions per game (at most %u), %.0f games/s\n"),
+           (unsigned long long)games, seconds, (double)questions / games, max_questions,
+           seconds > 0 ? games / seconds : 0.0);
+    if (wrong) {
+        printf(_("%llu games ended with a wrong number\n"), (unsigned long long)wrong);
+        return 1;
+    }
+    return 0;
+}
+
+/** Parse a bound of the range, from 0 to #GUESS_MAX.
+*
+* @return 0, or -1 if @p text is not such a number
+*/
+static int parse_bound(const char *text, uint64_t *bound) {
+    char *end;
+    if (text[0] == '-')
+        return -1;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*end != '\0' || end == text || value > GUESS_MAX)
+        return -1;
+    *bound = value;
+    return 0;
+}
+
 const char *argp_program_version = "guesser 0.1";
 const char *argp_program_bug_address = "<me@me.ru>";
 
 struct arguments {
     int use_roman;
+    int convert;
+    long benchmark;
+    uint64_t low;
+    uint64_t high;
+    int threads;
 };
 
 struct argp_option options[] = {
@@ -82,7 +496,43 @@ struct argp_option options[] = {
         0,
         0,
         "whether to use roman numerals in the program"
-    }
+    },
+    {
+        "convert",
+        'c',
+        0,
+        0,
+        "convert numbers read from stdin, arabic to roman and roman to arabic"
+    },
+    {
+        "benchmark",
+        'b',
+        "ROUNDS",
+        OPTION_ARG_OPTIONAL,
+        "compare the roman numeral codec with the old table lookup"
+    },
+    {
+        "low",
+        'l',
+        "N",
+        0,
+        "lower bound of the range, 1 by default"
+    },
+    {
+        "high",
+        'u',
+        "N",
+        0,
+        "upper bound of the range, 100 by default, at most 2^63"
+    },
+    {
+        "play-all",
+        'a',
+        "THREADS",
+        OPTION_ARG_OPTIONAL,
+        "play a game for every number in the range and report the statistics"
+    },
+    { 0 }
 };
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -91,6 +541,33 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         case 'r':
             arguments->use_roman = 1;
             break;
+        case 'c':
+            arguments->convert = 1;
+            break;
+        case 'b':
+            arguments->benchmark = arg ? atol(arg) : 1000000;
+            if (arguments->benchmark <= 0)
+                argp_error(state, "ROUNDS must be a positive number");
+            break;
+        case 'l':
+            if (parse_bound(arg, &arguments->low) != 0)
+                argp_error(state, "bounds must be numbers from 0 to 2^63");
+            break;
+        case 'u':
+            if (parse_bound(arg, &arguments->high) != 0)
+                argp_error(state, "bounds must be numbers from 0 to 2^63");
+            break;
+        case 'a':
+            arguments->threads = arg ? atoi(arg) : sysconf(_SC_NPROCESSORS_ONLN);
+            if (arguments->threads <= 0)
+                argp_error(state, "THREADS must be a positive number");
+            break;
+        case ARGP_KEY_END:
+            if (arguments->low > arguments->high)
+                argp_error(state, "the lower bound is above the upper one");
+            if (arguments->use_roman && (arguments->low < 1 || arguments->high > ROMAN_MAX))
+                argp_error(state, "roman numerals only go from 1 to %d", ROMAN_MAX);
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -104,64 +581,53 @@ static struct argp argp = { options, parse_opt, NULL, doc };
 /** @page guesser
 * Number guessing game
 * @section SYNOPSIS
-* `guesser` \a use_roman
+* `guesser` [\a --roman] [\a --low=N] [\a --high=N] [\a --convert] [\a --benchmark[=ROUNDS]] [\a --play-all[=THREADS]]
 * @section DESCRIPTION
-* Guess a number that was chosen by the user. Use roman numbers if \a use_roman is used.
+* Guess a number that was chosen by the user. Use roman numbers if \a --roman is used.
+*
+* With \a --convert, numbers are read from stdin one per line and written to
+* stdout converted: arabic numbers from 1 to 3999 to roman numerals and roman
+* numerals back to arabic. \a --benchmark measures conversions per second of
+* the codec against the table lookup it replaced.
+*
+* The range is 1 to 100 unless changed with \a --low and \a --high; it can
+* reach up to 2^63. \a --play-all plays a game for every number of the range
+* against the program itself, split between THREADS threads, and reports the
+* questions per game and the games per second.
 *
 * @copydetails library
 */
 int main(int argc, char** argv) {
     struct arguments arguments;
     arguments.use_roman = 0;
+    arguments.convert = 0;
+    arguments.benchmark = 0;
+    arguments.low = 1;
+    arguments.high = 100;
+    arguments.threads = 0;
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
-    int low = 1;
-    int high = 100;
-    int guess;
-    char answer[10];
+    uint64_t number;
+    unsigned questions;
     setlocale(LC_ALL, "");
     bindtextdomain(PACKAGE, LOCALEDIR);
     textdomain(PACKAGE);
-    if (arguments.use_roman)
-        printf(_("Think of a number between I and C.\n"));
-    else
-        printf(_("Think of a number between 1 and 100.\n"));
-
-    while (low <= high) {
-        guess = (low + high) / 2;
-
-        if (low == high) {
-            if (arguments.use_roman) 
-                printf(_("Your number: %s\n"), arabic_to_roman(guess));
-            else
-                printf(_("Your number: %d\n"), guess);
-            break;
-        }
-
-        while (1) {
-            if (arguments.use_roman) 
-                printf(_("Is your number bigger than %s? (Yes/No): "), arabic_to_roman(guess));
-            else
-                printf(_("Is your number bigger than %d? (Yes/No): "), guess);
-            
-            
-            if (fgets(answer, sizeof(answer), stdin) == NULL) {
-                printf(_("Input error.\n"));
-                return 1;
-            }
-
-            answer[strcspn(answer, "\n")] = 0;
-            
-            if (strcmp(answer, "Yes") == 0) {
-                low = guess + 1;
-                break;
-            } else if (strcmp(answer, "No") == 0) {
-                high = guess;
-                break;
-            } else {
-                printf(_("Invalid answer, it should be either yes or no.\n"));
-            }
-        }
+    load_prompts();
+    if (arguments.benchmark) {
+        run_benchmark(arguments.benchmark);
+        return 0;
     }
+    if (arguments.convert)
+        return run_convert();
+    if (arguments.threads)
+        return play_all(arguments.low, arguments.high, arguments.threads);
+
+    char low[32], high[32];
+    printf(_("Think of a number between %s and %s.\n"),
+           format_number(arguments.low, arguments.use_roman, low, sizeof(low)),
+           format_number(arguments.high, arguments.use_roman, high, sizeof(high)));
+    if (guess_number(arguments.low, arguments.high, ask_user, &arguments.use_roman, &number, &questions) != 0)
+        return 1;
+    printf(_("Your number: %s\n"), format_number(number, arguments.use_roman, low, sizeof(low)));
 
     return 0;
-}
\ No newline at end of file
+}
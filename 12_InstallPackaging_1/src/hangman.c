@@ -53,6 +53,7 @@
 #include <worddict.h>
 
 #define _(STRING) gettext(STRING)
+#define N_(STRING) STRING
 #define LOCALE_PATH "."
 #define DEFAULT_DATA_DIR "../game_data"
 #define INSTALL_DATA_DIR "/usr/share/hangman"
@@ -250,6 +251,112 @@ typedef struct {
     int won;
 } HangmanGame;
 
+/**
+ * @brief Messages of the game loop, translated once by load_messages()
+ */
+enum message {
+    MSG_WORD,
+    MSG_TRIES_LEFT,
+    MSG_GUESSED_LETTERS,
+    MSG_PROMPT,
+    MSG_INVALID_LETTER,
+    MSG_WON,
+    MSG_LOST,
+    MSG_WORD_WAS,
+    MSG_GALLOWS_TOP,
+    MSG_GALLOWS_ROPE,
+    MSG_GALLOWS_POLE,
+    MSG_GALLOWS_HEAD,
+    MSG_GALLOWS_ARM,
+    MSG_GALLOWS_ARMS,
+    MSG_GALLOWS_LEG,
+    MSG_GALLOWS_LEGS,
+    MSG_GALLOWS_GROUND,
+    MSG_COUNT
+};
+
+static const char* const message_ids[MSG_COUNT] = {
+    [MSG_WORD] = N_("Word: %s\n"),
+    [MSG_TRIES_LEFT] = N_("Tries left: %d\n"),
+    [MSG_GUESSED_LETTERS] = N_("Guessed letters: %s\n"),
+    [MSG_PROMPT] = N_("\nGuess a letter: "),
+    [MSG_INVALID_LETTER] = N_("Please enter a valid letter\n"),
+    [MSG_WON] = N_("\nCongratulations! You won!\n"),
+    [MSG_LOST] = N_("\nGame over! You lost.\n"),
+    [MSG_WORD_WAS] = N_("The word was: %s\n"),
+    [MSG_GALLOWS_TOP] = N_("  _______\n"),
+    [MSG_GALLOWS_ROPE] = N_("  |     |\n"),
+    [MSG_GALLOWS_POLE] = N_("  |\n"),
+    [MSG_GALLOWS_HEAD] = N_("  |     O\n"),
+    [MSG_GALLOWS_ARM] = N_("  |    /|\n"),
+    [MSG_GALLOWS_ARMS] = N_("  |    /|\\\n"),
+    [MSG_GALLOWS_LEG] = N_("  |    /\n"),
+    [MSG_GALLOWS_LEGS] = N_("  |    / \\\n"),
+    [MSG_GALLOWS_GROUND] = N_("__|________\n"),
+};
+
+#define GALLOWS_ROWS 7
+
+/**
+ * @brief Rows of the gallows picture for each number of tries left
+ *
+ * The body is the same row as the rope.
+ */
+static const unsigned char gallows_rows[MAX_TRIES + 1][GALLOWS_ROWS] = {
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_ARMS, MSG_GALLOWS_LEGS, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_ARMS, MSG_GALLOWS_LEG, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_ARMS, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_ARM, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_ROPE, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_HEAD, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+    { MSG_GALLOWS_TOP, MSG_GALLOWS_ROPE, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_POLE, MSG_GALLOWS_GROUND },
+};
+
+/** Translations of message_ids for the current locale */
+static const char* messages[MSG_COUNT];
+/** Each gallows picture in one buffer, followed by an empty line */
+static char* gallows_frames[MAX_TRIES + 1];
+static size_t gallows_frame_lengths[MAX_TRIES + 1];
+
+/**
+ * @brief Translate the game loop messages and assemble the gallows pictures
+ *
+ * Called once after the locale is set, so that no catalog lookup or
+ * formatting of constant text happens on every turn.
+ * @return 0, or -1 if out of memory
+ */
+static int load_messages(void) {
+    for (int i = 0; i < MSG_COUNT; i++) {
+        messages[i] = _(message_ids[i]);
+    }
+    for (int tries = 0; tries <= MAX_TRIES; tries++) {
+        size_t len = 1;
+        for (int row = 0; row < GALLOWS_ROWS; row++) {
+            len += strlen(messages[gallows_rows[tries][row]]);
+        }
+        char* frame = malloc(len + 1);
+        if (!frame) return -1;
+        char* end = frame;
+        for (int row = 0; row < GALLOWS_ROWS; row++) {
+            end = stpcpy(end, messages[gallows_rows[tries][row]]);
+        }
+        strcpy(end, "\n");
+        gallows_frames[tries] = frame;
+        gallows_frame_lengths[tries] = len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Free what load_messages() allocated
+ */
+static void free_messages(void) {
+    for (int tries = 0; tries <= MAX_TRIES; tries++) {
+        free(gallows_frames[tries]);
+        gallows_frames[tries] = NULL;
+    }
+}
+
 /**
  * @brief Create a game
  * @return Game
@@ -350,82 +457,28 @@ int is_win(const HangmanGame* game) {
 
 /**
  * @brief Draw the hangman
+ *
+ * The status lines are formatted into the same buffer as the preassembled
+ * gallows picture, which is then written with a single call.
  * @param game game struct
  */
 void hangman_draw(const HangmanGame* game) {
     if (!game) return;
 
-    printf("\n");
-    printf(_("Word: %s\n"), game->current_guess);
-    printf(_("Tries left: %d\n"), game->tries_left);
-    printf(_("Guessed letters: %s\n"), game->guessed_letters);
-    printf("\n");
-    switch (game->tries_left) {
-        case 6:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 5:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 4:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 3:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |    /|\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 2:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |    /|\\\n"));
-            printf(_("  |\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 1:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |    /|\\\n"));
-            printf(_("  |    /\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
-        case 0:
-            printf(_("  _______\n"));
-            printf(_("  |     |\n"));
-            printf(_("  |     O\n"));
-            printf(_("  |    /|\\\n"));
-            printf(_("  |    / \\\n"));
-            printf(_("  |\n"));
-            printf(_("__|________\n"));
-            break;
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer), "\n");
+    len += snprintf(buffer + len, sizeof(buffer) - len, messages[MSG_WORD], game->current_guess);
+    len += snprintf(buffer + len, sizeof(buffer) - len, messages[MSG_TRIES_LEFT], game->tries_left);
+    len += snprintf(buffer + len, sizeof(buffer) - len, messages[MSG_GUESSED_LETTERS], game->guessed_letters);
+    len += snprintf(buffer + len, sizeof(buffer) - len, "\n");
+    if (game->tries_left >= 0 && game->tries_left <= MAX_TRIES
+        && len + gallows_frame_lengths[game->tries_left] <= sizeof(buffer)) {
+        memcpy(buffer + len, gallows_frames[game->tries_left], gallows_frame_lengths[game->tries_left]);
+        len += gallows_frame_lengths[game->tries_left];
+    } else if (len >= (int)sizeof(buffer)) {
+        len = sizeof(buffer) - 1;
     }
-    printf("\n");
+    fwrite(buffer, 1, len, stdout);
 }
 
 /**
@@ -457,30 +510,30 @@ static int game(const GameConfig* config) {
 
     while (!is_game_over(game)) {
         hangman_draw(game);
-        printf(_("\nGuess a letter: "));
+        fputs(messages[MSG_PROMPT], stdout);
         char input[10];
         if (fgets(input, sizeof(input), stdin) == NULL) break;
         if (strlen(input) == 0) continue;
         char letter = input[0];
         if (!isalpha((unsigned char)letter)) {
-            printf(_("Please enter a valid letter\n"));
+            fputs(messages[MSG_INVALID_LETTER], stdout);
             continue;
         }
         guess_letter(game, letter);
         if (is_win(game)) {
-            printf(_("\nCongratulations! You won!\n"));
-            printf(_("The word was: %s\n"), word);
+            fputs(messages[MSG_WON], stdout);
+            printf(messages[MSG_WORD_WAS], word);
             cleanup(game);
             return 0;
         }
     }
     hangman_draw(game);
     if (is_win(game)) {
-        printf(_("\nCongratulations! You won!\n"));
-        printf(_("The word was: %s\n"), word);
+        fputs(messages[MSG_WON], stdout);
+        printf(messages[MSG_WORD_WAS], word);
     } else {
-        printf(_("\nGame over! You lost.\n"));
-        printf(_("The word was: %s\n"), word);
+        fputs(messages[MSG_LOST], stdout);
+        printf(messages[MSG_WORD_WAS], word);
     }
     cleanup(game);
     return 0;
@@ -507,6 +560,10 @@ int main(int argc, char** argv) {
     setlocale(LC_ALL, "");
     bindtextdomain(PACKAGE, LOCALE_PATH);
     textdomain(PACKAGE);
+    if (load_messages() != 0) {
+        fprintf(stderr, _("Failed to create game\n"));
+        return 1;
+    }
     while ((opt = getopt_long(argc, argv, "hvd:", 
                   long_options, &option_index)) != -1) {
                 switch (opt) {
@@ -525,5 +582,7 @@ int main(int argc, char** argv) {
         }
     }
 
-    return game(&config);
+    int status = game(&config);
+    free_messages();
+    return status;
 }
\ No newline at end of file